@@ -0,0 +1,144 @@
+#include "bandCache.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+
+using namespace cv;
+using namespace std;
+
+namespace tmpst{
+
+    namespace{
+        const char cache_magic[8] = {'T','M','P','S','T','B','C','1'};
+        const size_t cache_alignment = 64;
+
+        struct fileHeader{
+            char magic[8];
+            uint32_t band_count;
+            int32_t width, height;
+            int32_t frame_average;
+            double refresh;
+            double sample_rate;
+        };
+
+        struct bandHeader{
+            double frequency;
+            int64_t samples;
+            int32_t shift;
+            int32_t reserved;
+        };
+
+        size_t aligned(size_t offset){ return (offset+cache_alignment-1)/cache_alignment*cache_alignment; }
+    }
+
+    bool writeBandCache(string filename, const cacheInfo & info, const vector<cachedBand> & bands){
+        ofstream output(filename, ios::binary);
+        if(!output){
+            cerr << "Could not open band cache: " << filename << endl;
+            return false;
+        }
+
+        fileHeader header;
+        memcpy(header.magic, cache_magic, sizeof(cache_magic));
+        header.band_count = bands.size();
+        header.width = info.width;
+        header.height = info.height;
+        header.frame_average = info.frame_average;
+        header.refresh = info.refresh;
+        header.sample_rate = info.sample_rate;
+
+        const char padding[cache_alignment] = {0};
+        output.write((const char *) &header, sizeof(header));
+        size_t offset = sizeof(header);
+
+        for(const cachedBand & band : bands){
+            Mat frame;
+            band.frame.convertTo(frame, CV_32F);
+
+            output.write(padding, aligned(offset)-offset);
+            offset = aligned(offset);
+
+            bandHeader record;
+            record.frequency = band.frequency;
+            record.samples = frame.total();
+            record.shift = band.shift;
+            record.reserved = 0;
+
+            output.write((const char *) &record, sizeof(record));
+            output.write((const char *) frame.ptr<float>(0), frame.total()*sizeof(float));
+            offset += sizeof(record) + frame.total()*sizeof(float);
+        }
+
+        if(!output){
+            cerr << "Could not write band cache: " << filename << endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool readBandCache(string filename, cacheInfo & info, vector<cachedBand> & bands){
+        int file_descriptor = open(filename.c_str(), O_RDONLY);
+        if(file_descriptor < 0){
+            cerr << "Could not open band cache: " << filename << endl;
+            return false;
+        }
+
+        struct stat file_stats;
+        if(fstat(file_descriptor, &file_stats) < 0 || size_t(file_stats.st_size) < sizeof(fileHeader)){
+            cerr << "Band cache is too short: " << filename << endl;
+            close(file_descriptor);
+            return false;
+        }
+
+        size_t file_size = file_stats.st_size;
+        void * mapped = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+        close(file_descriptor); // mapping stays valid after closing
+        if(mapped == MAP_FAILED){
+            cerr << "Could not memory map band cache: " << filename << endl;
+            return false;
+        }
+
+        const char * data = (const char *) mapped;
+        const fileHeader * header = (const fileHeader *) data;
+        bool valid = memcmp(header->magic, cache_magic, sizeof(cache_magic)) == 0;
+
+        if(valid){
+            info.width = header->width;
+            info.height = header->height;
+            info.frame_average = header->frame_average;
+            info.refresh = header->refresh;
+            info.sample_rate = header->sample_rate;
+
+            bands.clear();
+            size_t offset = sizeof(fileHeader);
+            for(uint32_t b=0; b<header->band_count && valid; b++){
+                offset = aligned(offset);
+                const bandHeader * record = (const bandHeader *) (data+offset);
+                offset += sizeof(bandHeader);
+
+                valid = offset <= file_size && record->samples > 0
+                        && offset+record->samples*sizeof(float) <= file_size;
+                if(!valid) break;
+
+                cachedBand band;
+                band.frequency = record->frequency;
+                band.shift = record->shift;
+                band.frame = Mat(1, record->samples, CV_32F, (void *) (data+offset)).clone();
+                bands.push_back(band);
+
+                offset += record->samples*sizeof(float);
+            }
+        }
+
+        munmap(mapped, file_size);
+
+        if(!valid) cerr << "Not a band cache, or it is cut short: " << filename << endl;
+        return valid;
+    }
+
+}
@@ -0,0 +1,36 @@
+#ifndef _BANDCACHE_H_
+#define _BANDCACHE_H_
+#include <opencv2/core/utility.hpp>
+#include <string>
+#include <vector>
+
+namespace tmpst{
+
+    /**
+     * What the bands of one run were captured with
+     */
+    struct cacheInfo{
+        int width, height;
+        double refresh;
+        double sample_rate;
+        int frame_average;
+    };
+
+    /**
+     * One band: its averaged frame (averageFrames output, CV_32F) and the shift it was made with
+     */
+    struct cachedBand{
+        double frequency;
+        int shift;
+        cv::Mat frame;
+    };
+
+    /**
+     * The cache is a fixed header, then per band a small record followed by its floats
+     * (every record starts on a 64 byte boundary). Read back with a memory map.
+     */
+    bool writeBandCache(std::string filename, const cacheInfo & info, const std::vector<cachedBand> & bands);
+    bool readBandCache(std::string filename, cacheInfo & info, std::vector<cachedBand> & bands);
+
+}
+#endif
@@ -0,0 +1,209 @@
+#include "batch.h"
+#include "tempest.h"
+#include "boundedQueue.h"
+#include "imageWriter.h"
+#include "trace.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+using namespace cv;
+using namespace std;
+
+namespace tmpst{
+
+    batchRunner::batchRunner(function<tempest *(const batchJob &)> make, string output_root):
+                            make(make), output_root(output_root){
+        if(!this->output_root.empty() && this->output_root.back() != '/') this->output_root += '/';
+    }
+
+    vector<batchJob> & batchRunner::getJobs(){ return jobs; }
+
+    /**
+     * Reads the captures to run, either every file in a directory or a manifest with one capture a line:
+     *      capture [resolution] [refresh]
+     * a resolution of - keeps --res, # starts a comment. Relative paths are from the manifest.
+     * Every job gets its own output folder (named after the capture) in the output root.
+     */
+    bool batchRunner::load(string path){
+        struct stat path_stats;
+        if(stat(path.c_str(), &path_stats) < 0){
+            cerr << "Could not find batch input: " << path << endl;
+            return false;
+        }
+
+        if(S_ISDIR(path_stats.st_mode)){
+            if(path.back() != '/') path += '/';
+
+            DIR * directory = opendir(path.c_str());
+            if(!directory){
+                cerr << "Could not open batch directory: " << path << endl;
+                return false;
+            }
+
+            vector<string> names;
+            while(dirent * entry = readdir(directory)){
+                string name = entry->d_name;
+                struct stat file_stats;
+                if(name[0] != '.' && stat((path+name).c_str(), &file_stats) == 0 && S_ISREG(file_stats.st_mode))
+                    names.push_back(name);
+            }
+            closedir(directory);
+
+            sort(names.begin(), names.end()); // same order every night
+            for(string & name : names){
+                batchJob job;
+                job.input_file = path+name;
+                jobs.push_back(job);
+            }
+        }else{
+            ifstream manifest(path);
+            string base = (path.find('/') == string::npos) ? "" : path.substr(0, path.rfind('/')+1);
+            string line;
+            int line_number = 0;
+
+            while(getline(manifest, line)){
+                line_number++;
+                line = line.substr(0, line.find('#'));
+
+                istringstream fields(line);
+                batchJob job;
+                if(!(fields >> job.input_file)) continue; // empty line
+
+                string resolution, refresh;
+                if(fields >> resolution && resolution != "-") job.resolution = resolution;
+                if(fields >> refresh){
+                    try{
+                        job.refresh = stod(refresh);
+                    }catch(exception & e){
+                        cerr << "Bad refresh rate on line " << line_number << " of " << path << endl;
+                        return false;
+                    }
+                }
+
+                if(job.input_file[0] != '/') job.input_file = base+job.input_file;
+                jobs.push_back(job);
+            }
+        }
+
+        for(size_t i=0; i<jobs.size(); i++){
+            string stem = jobs[i].input_file.substr(jobs[i].input_file.rfind('/')+1);
+            stem = stem.substr(0, stem.rfind('.'));
+            jobs[i].output_dir = output_root+stem+"/";
+
+            for(size_t j=0; j<i; j++){
+                if(jobs[j].output_dir == jobs[i].output_dir){
+                    jobs[i].output_dir = output_root+stem+"-"+to_string(i)+"/";
+                    break;
+                }
+            }
+        }
+
+        if(jobs.empty()) cerr << "No captures found in " << path << endl;
+        return !jobs.empty();
+    }
+
+    void batchRunner::runJob(batchJob & job, Mat & sample_buffer){
+        TRACE_SCOPE("batch job");
+        auto start = chrono::steady_clock::now();
+        mkdir(job.output_dir.c_str(), 0755);
+
+        unique_ptr<tempest> job_tempest(make(job));
+        if(!job_tempest){
+            job.error = "invalid settings";
+        }else{
+            job_tempest->setSampleBuffer(&sample_buffer);
+            job_tempest->initializeBands();
+
+            if(job_tempest->processBands()){
+                job_tempest->combineBands();
+                job.shift = job_tempest->getShift();
+                job.output = job_tempest->finalImage(0)+imageWriter::shared().extension();
+                job.done = true;
+            }else{
+                job.error = "could not load the capture";
+            }
+        }
+
+        job.seconds = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+    }
+
+    /**
+     * Runs every job on workers threads, each with threads processing threads (0 shares the cores out).
+     */
+    void batchRunner::run(int workers, int threads){
+        worker_count = max(1, workers);
+        if(threads <= 0) threads = max(1, omp_get_max_threads()/worker_count);
+
+        boundedQueue<size_t> pending(jobs.size()+1);
+        for(size_t i=0; i<jobs.size(); i++) pending.push(i);
+        pending.close(); // the workers drain it
+
+        mkdir(output_root.c_str(), 0755);
+        auto start = chrono::steady_clock::now();
+
+        vector<thread> pool;
+        for(int w=0; w<worker_count; w++){
+            pool.push_back(thread([this, &pending, threads](){
+                omp_set_num_threads(threads);
+                Mat sample_buffer; // grows to the largest capture and stays
+
+                size_t index;
+                while(pending.pop(index)){
+                    runJob(jobs[index], sample_buffer);
+                    cout << "Batch " << index+1 << "/" << jobs.size() << " " << jobs[index].input_file << ": "
+                         << ((jobs[index].done) ? "done" : jobs[index].error) << " in " << jobs[index].seconds << "s" << endl;
+                }
+            }));
+        }
+        for(thread & worker : pool) worker.join();
+
+        total_seconds = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+    }
+
+    /**
+     * Json summary of the batch (per job timings, shifts and outputs)
+     */
+    bool batchRunner::writeSummary(string filename){
+        auto quote = [](string text){
+            string quoted = "\"";
+            for(char c : text){
+                if(c == '"' || c == '\\') quoted += '\\';
+                quoted += c;
+            }
+            return quoted+"\"";
+        };
+
+        int done = 0;
+        for(batchJob & job : jobs) done += job.done;
+
+        ofstream summary(filename);
+        summary << "{" << endl
+                << "  \"workers\": " << worker_count << "," << endl
+                << "  \"seconds\": " << total_seconds << "," << endl
+                << "  \"done\": " << done << "," << endl
+                << "  \"failed\": " << jobs.size()-done << "," << endl
+                << "  \"jobs\": [" << endl;
+        for(size_t i=0; i<jobs.size(); i++){
+            batchJob & job = jobs[i];
+            summary << "    {\"input\": " << quote(job.input_file)
+                    << ", \"resolution\": " << quote(job.resolution) << ", \"refresh\": " << job.refresh
+                    << ", \"done\": " << ((job.done) ? "true" : "false") << ", \"seconds\": " << job.seconds
+                    << ", \"shift\": " << job.shift << ", \"output\": " << quote(job.output)
+                    << ", \"error\": " << quote(job.error) << "}" << ((i+1<jobs.size()) ? "," : "") << endl;
+        }
+        summary << "  ]" << endl << "}" << endl;
+
+        cout << "Batch: " << done << " of " << jobs.size() << " captures in " << total_seconds << "s with "
+             << worker_count << " workers" << endl;
+        return bool(summary);
+    }
+
+}
@@ -0,0 +1,55 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+#include <string>
+#include <vector>
+#include <functional>
+#include <opencv2/core/utility.hpp>
+
+namespace tmpst{
+
+    class tempest;
+
+    /**
+     * One capture of a batch, with what came of it
+     */
+    struct batchJob{
+        std::string input_file;
+        std::string resolution;     // empty keeps --res
+        double refresh = 0;         // 0 keeps --refresh
+        std::string output_dir;
+
+        bool done = false;
+        double seconds = 0;
+        int shift = 0;
+        std::string output;         // the final image
+        std::string error;
+    };
+
+    /**
+     * Processes many captures with a fixed pool of workers.
+     * make builds the tempest of a job (with the command line settings and the job's overrides),
+     * returning NULL when the job's settings are not valid.
+     * Every worker keeps its sample buffer (and the correlation buffers of its threads) from job to job.
+     */
+    class batchRunner{
+    private:
+        std::vector<batchJob> jobs;
+        std::function<tempest *(const batchJob &)> make;
+        std::string output_root;
+        double total_seconds = 0;
+        int worker_count = 0;
+
+        void runJob(batchJob & job, cv::Mat & sample_buffer);
+
+    public:
+        batchRunner(std::function<tempest *(const batchJob &)> make, std::string output_root);
+
+        bool load(std::string path);    // a directory of captures or a manifest
+        void run(int workers, int threads);
+        bool writeSummary(std::string filename);
+
+        std::vector<batchJob> & getJobs();
+    };
+
+}
+#endif
@@ -0,0 +1,288 @@
+// Program options
+#include <boost/program_options.hpp>
+#include <boost/format.hpp>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <map>
+#include <algorithm>
+#include <omp.h>
+#include <sys/stat.h>
+// internal
+#include "tempest.h"
+#include "frameStream.h"
+#include "signalGenerator.h"
+#include "sampleSource.h"
+#include "kernels.h"
+
+namespace ops = boost::program_options;
+using namespace cv;
+using namespace std;
+
+namespace tmpst{
+
+    /**
+     * Times every processing stage on generated captures.
+     * A friend of frameStream and tempest so the private stages can be timed one by one,
+     * in the same order createFinalFrame runs them.
+     */
+    class benchmark{
+    private:
+        int repeats;
+        string work_dir;
+        vector<string> results;     // one json object per stage
+
+        void record(string resolution, int average, int shift_max, string stage, vector<double> & times);
+
+    public:
+        benchmark(int repeats, string work_dir): repeats(repeats), work_dir(work_dir) {};
+
+        bool run(string resolution, double refresh, double rate, int average, int shift_max, string filename);
+        bool headroom(string resolution, double refresh, double rate, int average, double buffer_time);
+        string json();
+    };
+
+    void benchmark::record(string resolution, int average, int shift_max, string stage, vector<double> & times){
+        double best = times[0], total = 0;
+        for(double time : times){
+            best = min(best, time);
+            total += time;
+        }
+
+        ostringstream result;
+        result << "{\"resolution\": \"" << resolution << "\", \"average\": " << average << ", \"max_shift\": " << shift_max
+               << ", \"stage\": \"" << stage << "\", \"min_ms\": " << best*1000 << ", \"mean_ms\": " << total/times.size()*1000
+               << ", \"repeats\": " << times.size() << "}";
+        results.push_back(result.str());
+
+        cout << boost::format("%-14s avg %-3d shift %-4d %-16s %10.3fms (mean %.3fms)")
+                % resolution % average % shift_max % stage % (best*1000) % (total/times.size()*1000) << endl;
+    }
+
+    /**
+     * One point of the matrix: every stage of one band, then combineBands on three copies of it
+     */
+    bool benchmark::run(string resolution, double refresh, double rate, int average, int shift_max, string filename){
+        signalGenerator timing(resolution.substr(0, resolution.find('@')), refresh, rate);
+        int width = timing.getWidth(), height = timing.getHeight();
+
+        map<string, vector<double>> times;
+        auto elapsed = [](chrono::steady_clock::time_point start){
+            return chrono::duration<double>(chrono::steady_clock::now()-start).count();
+        };
+
+        frameStream finished;
+        for(int r=0; r<repeats; r++){
+            frameStream band(width, height, refresh, 0, average, rate, false, false, false, work_dir);
+
+            auto start = chrono::steady_clock::now();
+            if(!band.loadDataFile(filename, 0)) return false;
+            times["loadDataFile"].push_back(elapsed(start));
+
+            for(int i=0; i<average; i++) band.indices[i] = band.pixels_per_image*i;
+
+            // the same capture through the sample source path (the receiver loader)
+            {
+                frameStream streamed(width, height, refresh, 0, average, rate, false, false, false, work_dir);
+                fileSource replay(filename, rate);
+                if(!replay.valid()) return false;
+
+                start = chrono::steady_clock::now();
+                replay.stream(streamed.pixels_per_image*(average+1), -1);
+                streamed.loadDataSource(replay, 0);
+                times["loadDataSource"].push_back(elapsed(start));
+            }
+
+            start = chrono::steady_clock::now();
+            int shift_amount = (average==1) ? 0 : mapMode(band.corrolateFrames(shift_max)).first;
+            times["corrolateFrames"].push_back(elapsed(start));
+
+            // same shifting createFinalFrame does
+            int total_shift = 0;
+            for(int i=1; i<average; i++){
+                total_shift += shift_amount;
+                band.indices[i] = band.shiftIndex(band.indices[i], total_shift);
+            }
+            if(average!=1) band.pixels_per_image = band.indices[1] - band.indices[0];
+
+            start = chrono::steady_clock::now();
+            Mat one_frame = band.averageFrames(band.indices);
+            times["averageFrames"].push_back(elapsed(start));
+
+            start = chrono::steady_clock::now();
+            band.writeMiniFrame(one_frame);
+            times["writeMiniFrame"].push_back(elapsed(start));
+
+            start = chrono::steady_clock::now();
+            band.centerImage(band.final_mini_image);
+            times["centerImage"].push_back(elapsed(start));
+
+            if(r == 0){
+                // a whole band for combineBands
+                finished = frameStream(width, height, refresh, 0, average, rate, false, false, false, work_dir);
+                finished.loadDataFile(filename, 0);
+                finished.createFinalFrame(finished.processSamples(shift_max).first);
+            }
+        }
+
+        tempest combiner(filename, work_dir, width, height, refresh, average, rate, 0, shift_max, false, false, false);
+        for(int r=0; r<repeats; r++){
+            // combineBands shifts the images in place, so every run starts from fresh copies
+            combiner.bands = vector<frameStream>(3, finished);
+            for(frameStream & band : combiner.bands) band.final_image = finished.final_image.clone();
+
+            auto start = chrono::steady_clock::now();
+            combiner.combineBands();
+            times["combineBands"].push_back(elapsed(start));
+        }
+
+        const char * stages[] = {"loadDataFile", "loadDataSource", "corrolateFrames", "averageFrames", "writeMiniFrame", "centerImage", "combineBands"};
+        for(const char * stage : stages)
+            record(resolution, average, shift_max, stage, times[stage]);
+
+        return true;
+    }
+
+    /**
+     * One real time burst from the simulated receiver through loadDataSource at rate.
+     * Sustained when the device buffer never ran over, headroom is the part of the burst
+     * the receiving thread spent waiting on samples (0 is just keeping up).
+     */
+    bool benchmark::headroom(string resolution, double refresh, double rate, int average, double buffer_time){
+        signalGenerator timing(resolution.substr(0, resolution.find('@')), refresh, rate);
+        frameStream band(timing.getWidth(), timing.getHeight(), refresh, 0, average, rate, false, false, false, work_dir);
+
+        simSource source(rate, refresh, 0, true);
+        source.setFaults(0, 0, buffer_time);
+
+        long burst = band.pixels_per_image*(average+1);
+        source.tune(0, 0, -1);
+        source.stream(burst, -1);
+
+        auto start = chrono::steady_clock::now();
+        bool sustained = band.loadDataSource(source, 0) && source.overflows == 0;
+        double taken = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+        double headroom = source.idle_seconds/(burst/rate);
+
+        ostringstream result;
+        result << "{\"resolution\": \"" << resolution << "\", \"average\": " << average
+               << ", \"stage\": \"rx headroom\", \"rate\": " << rate << ", \"sustained\": " << ((sustained) ? "true" : "false")
+               << ", \"headroom\": " << headroom << ", \"seconds\": " << taken << "}";
+        results.push_back(result.str());
+
+        cout << boost::format("%-14s avg %-3d rx at %6.1fMsps %-11s headroom %5.1f%%")
+                % resolution % average % (rate/1e6) % ((sustained) ? "sustained" : "overflowed") % (headroom*100) << endl;
+
+        return sustained;
+    }
+
+    string benchmark::json(){
+        ostringstream output;
+        output << "{" << endl
+               << "  \"kernels\": \"" << kernels::levelName(kernels::currentLevel()) << "\"," << endl
+               << "  \"threads\": " << omp_get_max_threads() << "," << endl
+               << "  \"results\": [" << endl;
+        for(size_t i=0; i<results.size(); i++)
+            output << "    " << results[i] << ((i+1<results.size()) ? "," : "") << endl;
+        output << "  ]" << endl << "}" << endl;
+        return output.str();
+    }
+
+}
+
+/**
+ * Splits a comma seperated list
+ */
+vector<string> splitList(string list){
+    vector<string> items;
+    stringstream stream(list);
+    string item;
+    while(getline(stream, item, ',')) if(!item.empty()) items.push_back(item);
+    return items;
+}
+
+/**
+ * Benchmark of the processing stages over a matrix of resolutions, frame averages and max shifts.
+ * The captures are generated, so no receiver or recording is needed.
+ */
+int main(int argc, char * argv[]){
+    string resolutions, averages, shifts, output_file, work_dir, headroom_rates;
+    double rate, refresh_error, noise, buffer_time;
+    int repeats, threads;
+
+    ops::options_description desc("Available Options");
+    desc.add_options()
+        ("help",                                                                                        "help message")
+        ("res",         ops::value<string>(&resolutions)->      default_value("640x480@60,1024x768@60,1920x1080@60"), "resolutions with refresh rates to run")
+        ("average",     ops::value<string>(&averages)->         default_value("2,5,10"),                "frame average amounts to run")
+        ("max_shift",   ops::value<string>(&shifts)->           default_value("50,200"),                "max shift amounts to run")
+        ("rate",        ops::value<double>(&rate)->             default_value(25e6),                    "sample rate of the generated captures")
+        ("error",       ops::value<double>(&refresh_error)->    default_value(20.0),                    "ppm refresh error of the generated captures")
+        ("noise",       ops::value<double>(&noise)->            default_value(50.0),                    "noise of the generated captures")
+        ("repeat",      ops::value<int>(&repeats)->             default_value(3),                       "times every stage is run")
+        ("threads",     ops::value<int>(&threads)->             default_value(0),                       "amount of threads used for processing (0 uses every core)")
+        ("headroom",    ops::value<string>(&headroom_rates)->   default_value(""),                      "sample rates to receive from the real time simulated receiver, to find the highest one sustained (eg 10e6,25e6,50e6)")
+        ("buffer",      ops::value<double>(&buffer_time)->      default_value(0.05),                    "seconds of samples the simulated receiver holds before overflowing")
+        ("dir",         ops::value<string>(&work_dir)->         default_value("bench/"),                "folder for the generated captures and images")
+        ("out",         ops::value<string>(&output_file)->      default_value("bench.json"),            "json file the results are written to")
+    ;
+
+    ops::variables_map var_map;
+    ops::store(ops::parse_command_line(argc, argv, desc), var_map);
+    ops::notify(var_map);
+
+    if (var_map.count("help")) {
+        std::cout << boost::format("Tempest benchmark %s") % desc << std::endl;
+        return ~0;
+    }
+
+    if(threads > 0) omp_set_num_threads(threads);
+    mkdir(work_dir.c_str(), 0755);
+
+    vector<int> average_list, shift_list;
+    for(string & item : splitList(averages)) average_list.push_back(stoi(item));
+    for(string & item : splitList(shifts)) shift_list.push_back(stoi(item));
+    int most_frames = *max_element(average_list.begin(), average_list.end());
+
+    tmpst::benchmark bench(max(repeats, 1), work_dir);
+
+    for(string & resolution : splitList(resolutions)){
+        double refresh = stod(resolution.substr(resolution.find('@')+1));
+
+        // one capture per resolution, long enough for the largest average
+        tmpst::signalGenerator generator(resolution.substr(0, resolution.find('@')), refresh, rate);
+        if(!generator.valid()){
+            cerr << "Skipping " << resolution << ", it is not in the resolution table" << endl;
+            continue;
+        }
+        generator.setRefreshError(refresh_error, 0);
+        generator.setNoise(noise);
+
+        string filename = work_dir+"capture-"+resolution+".dat";
+        if(!generator.writeFile(filename, most_frames+2)) return -1;
+
+        for(int average : average_list)
+            for(int shift_max : shift_list)
+                if(!bench.run(resolution, refresh, rate, average, shift_max, filename))
+                    cerr << "Could not run " << resolution << " with average " << average << endl;
+
+        remove(filename.c_str());
+
+        // receiving, at real time
+        double best_rate = 0;
+        for(string & item : splitList(headroom_rates)){
+            double headroom_rate = stod(item);
+            if(bench.headroom(resolution, refresh, headroom_rate, average_list[0], buffer_time))
+                best_rate = max(best_rate, headroom_rate);
+        }
+        if(!headroom_rates.empty())
+            cout << resolution << " highest sustained rate: " << best_rate/1e6 << "Msps" << endl;
+    }
+
+    ofstream output(output_file);
+    output << bench.json();
+    cout << "Results written to " << output_file << endl;
+
+    return 0;
+}
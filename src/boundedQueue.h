@@ -0,0 +1,62 @@
+#ifndef _BOUNDEDQUEUE_H_
+#define _BOUNDEDQUEUE_H_
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+namespace tmpst{
+
+    /**
+     * Blocking queue between producer and consumer threads.
+     * push waits while the queue is full (backpressure), pop waits while it is empty.
+     * After close, pushes fail and pops drain what is left then fail.
+     */
+    template<typename T>
+    class boundedQueue{
+    private:
+        std::deque<T> items;
+        size_t capacity;
+        bool closed;
+
+        std::mutex lock;
+        std::condition_variable not_full, not_empty;
+
+    public:
+        boundedQueue(size_t capacity): capacity(capacity), closed(false) {};
+
+        bool push(T item){
+            std::unique_lock<std::mutex> guard(lock);
+            not_full.wait(guard, [this]{ return closed || items.size() < capacity; });
+            if(closed) return false;
+
+            items.push_back(std::move(item));
+            not_empty.notify_one();
+            return true;
+        }
+
+        bool pop(T & item){
+            std::unique_lock<std::mutex> guard(lock);
+            not_empty.wait(guard, [this]{ return closed || !items.empty(); });
+            if(items.empty()) return false;
+
+            item = std::move(items.front());
+            items.pop_front();
+            not_full.notify_one();
+            return true;
+        }
+
+        void close(){
+            std::lock_guard<std::mutex> guard(lock);
+            closed = true;
+            not_full.notify_all();
+            not_empty.notify_all();
+        }
+
+        size_t size(){
+            std::lock_guard<std::mutex> guard(lock);
+            return items.size();
+        }
+    };
+
+}
+#endif
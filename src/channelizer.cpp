@@ -0,0 +1,146 @@
+#include "channelizer.h"
+#include "trace.h"
+#include <opencv2/core/utility.hpp>
+#include <opencv2/opencv.hpp>
+#include <cmath>
+#include <omp.h>
+
+using namespace cv;
+using namespace std;
+
+namespace tmpst{
+
+    /**
+     * Prototype lowpass is a windowed sinc (Blackman) cut off at half the channel rate,
+     * with unity gain so a channel keeps the level of the capture.
+     */
+    channelizer::channelizer(int channels, int decimation, int taps_per_branch):
+                            channels(max(channels, 1)), decimation(max(decimation, 1)),
+                            taps_per_branch(max(taps_per_branch, 1)){
+
+        int M = this->channels, K = this->taps_per_branch;
+        int length = K*M;
+        double cutoff = 0.5/this->decimation; // of the capture rate
+
+        vector<double> prototype(length);
+        double total = 0;
+        for(int l=0; l<length; l++){
+            double t = l - (length-1)/2.0;
+            double sinc = (t == 0) ? 2*cutoff : sin(2*M_PI*cutoff*t)/(M_PI*t);
+            double window = 0.42 - 0.5*cos(2*M_PI*l/(length-1)) + 0.08*cos(4*M_PI*l/(length-1));
+            prototype[l] = sinc*window;
+            total += prototype[l];
+        }
+
+        // branch k holds taps kM .. kM+M-1 backwards, so the inner loop walks the input forwards
+        branches.resize(length);
+        for(int k=0; k<K; k++)
+            for(int m=0; m<M; m++)
+                branches[k*M + (M-1-m)] = float(prototype[k*M+m]/total);
+
+        twiddle.resize(M);
+        for(int k=0; k<M; k++) twiddle[k] = polar(1.0f, float(-2*M_PI*k/M));
+    }
+
+    int channelizer::getChannels(){ return channels; }
+    int channelizer::getDecimation(){ return decimation; }
+    size_t channelizer::historyLength(){ return size_t(taps_per_branch)*channels - 1; }
+
+    size_t channelizer::outputLength(size_t input){
+        size_t first = (historyLength()+decimation-1)/decimation;
+        if(input == 0 || (input-1)/decimation < first) return 0;
+        return (input-1)/decimation - first + 1;
+    }
+
+    /**
+     * Channel c of output n is
+     *      e^(-j2pi c nD/M) * sum_m u[m] e^(j2pi cm/M),   u[m] = sum_k h[m+kM] x[nD-m-kM]
+     * so every output is M*K multiply adds for the branches then one inverse FFT for all the channels.
+     * Blocks of outputs are spread over the threads, each block goes through one row wise dft.
+     * wanted are the channels to keep (outputs[i] is channel wanted[i]).
+     */
+    void channelizer::process(const complex<short> * input, size_t count, const vector<int> & wanted,
+                              vector<vector<complex<short>>> & outputs){
+        TRACE_SCOPE("channelize");
+        int M = channels, K = taps_per_branch, D = decimation;
+        size_t output_count = outputLength(count);
+        long first = (historyLength()+D-1)/D;
+
+        outputs.assign(wanted.size(), vector<complex<short>>(output_count));
+        if(output_count == 0) return;
+
+        vector<int> bins(wanted.size());
+        for(size_t w=0; w<wanted.size(); w++) bins[w] = ((wanted[w]%M)+M)%M;
+
+        const int block = 512;
+        long blocks = (long(output_count)+block-1)/block;
+        long history = long(historyLength());
+
+#pragma omp parallel
+        {
+            Mat branch_sums(block, M, CV_32FC2), spectrum;
+            vector<float> sum_real(M), sum_imaginary(M);
+
+            // the input a block reads, split into real and imaginary so the branch loops are plain float multiply adds
+            vector<float> real(size_t(block-1)*D + history + 1), imaginary(real.size());
+
+#pragma omp for schedule(dynamic)
+            for(long b=0; b<blocks; b++){
+                long start = b*block;
+                int rows = int(min(long(block), long(output_count)-start));
+
+                long window = (first+start)*D - history; // first input sample of the block
+                long window_length = long(rows-1)*D + history + 1;
+                for(long i=0; i<window_length; i++){
+                    real[i] = input[window+i].real();
+                    imaginary[i] = input[window+i].imag();
+                }
+
+                for(int r=0; r<rows; r++){
+                    long n = first+start+r;
+                    fill(sum_real.begin(), sum_real.end(), 0.0f);
+                    fill(sum_imaginary.begin(), sum_imaginary.end(), 0.0f);
+
+                    for(int k=0; k<K; k++){
+                        const float * taps = &branches[k*M];
+                        long base = n*D - long(k)*M - (M-1) - window;
+                        const float * in_real = &real[base];
+                        const float * in_imaginary = &imaginary[base];
+                        float * out_real = &sum_real[0];
+                        float * out_imaginary = &sum_imaginary[0];
+
+#pragma omp simd
+                        for(int m=0; m<M; m++){
+                            out_real[m] += taps[m]*in_real[m];
+                            out_imaginary[m] += taps[m]*in_imaginary[m];
+                        }
+                    }
+
+                    // the sums came out backwards (see branches)
+                    float * row = branch_sums.ptr<float>(r);
+                    for(int m=0; m<M; m++){
+                        row[2*(M-1-m)] = sum_real[m];
+                        row[2*(M-1-m)+1] = sum_imaginary[m];
+                    }
+                }
+
+                dft(branch_sums.rowRange(0, rows), spectrum, DFT_ROWS | DFT_INVERSE | DFT_COMPLEX_OUTPUT);
+
+                for(int r=0; r<rows; r++){
+                    long n = first+start+r;
+                    long phase = (n*D)%M;
+                    const float * row = spectrum.ptr<float>(r);
+
+                    for(size_t w=0; w<bins.size(); w++){
+                        complex<float> value(row[2*bins[w]], row[2*bins[w]+1]);
+                        value *= twiddle[(long(bins[w])*phase)%M];
+
+                        outputs[w][start+r] = complex<short>(saturate_cast<short>(value.real()),
+                                                             saturate_cast<short>(value.imag()));
+                    }
+                }
+            }
+        }
+    }
+
+}
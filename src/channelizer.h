@@ -0,0 +1,38 @@
+#ifndef _CHANNELIZER_H_
+#define _CHANNELIZER_H_
+#include <complex>
+#include <vector>
+
+namespace tmpst{
+
+    /**
+     * Polyphase FFT filter bank.
+     * Splits a wideband capture (rate) into channels spaced rate/channels apart, each lowpass filtered
+     * and decimated to rate/decimation. With decimation below channels the channels overlap, the same
+     * way the swept bands overlap (bandwidth_overlap).
+     * Channel 0 is the centre of the capture, negative channels are below it.
+     */
+    class channelizer{
+    private:
+        int channels;           // M
+        int decimation;         // D
+        int taps_per_branch;    // K, the prototype filter has K*M taps
+
+        std::vector<float> branches;                // taps, K rows of M, each row reversed
+        std::vector<std::complex<float>> twiddle;   // e^(-j2pi k/M)
+
+    public:
+        channelizer(int channels, int decimation, int taps_per_branch = 12);
+
+        int getChannels();
+        int getDecimation();
+        size_t historyLength();                 // input samples before the first output
+        size_t outputLength(size_t input);      // outputs per channel from input samples
+
+        void process(const std::complex<short> * input, size_t count, const std::vector<int> & wanted,
+                     std::vector<std::vector<std::complex<short>>> & outputs);
+    };
+
+}
+
+#endif
@@ -0,0 +1,132 @@
+#include "correlator.h"
+#include "extraMath.h"
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc.hpp>
+#include <iostream>
+#include <limits>
+
+using namespace cv;
+using namespace std;
+
+namespace tmpst{
+
+    correlator::correlator(): frame_size(0), max_lag(0), dft_size(0) {};
+
+    /**
+     * Sizes the buffers, nothing is reallocated if the sizes are the same as last time
+     */
+    void correlator::setup(int frame_size, int max_lag){
+        if(frame_size==this->frame_size && max_lag==this->max_lag) return;
+
+        this->frame_size = frame_size;
+        this->max_lag = max_lag;
+
+        // the moving window is frame+2*lag long, at least that big means no circular wrap
+        dft_size = getOptimalDFTSize(frame_size+2*max_lag);
+
+        reference_buffer = Mat::zeros(1, dft_size, CV_64F);
+        moving_buffer = Mat::zeros(1, dft_size, CV_64F);
+        reference_spectrum = Mat::zeros(1, dft_size, CV_64F);
+        moving_spectrum = Mat::zeros(1, dft_size, CV_64F);
+        product = Mat::zeros(1, dft_size, CV_64F);
+        lags = Mat::zeros(1, dft_size, CV_64F);
+        shifts = lags.colRange(0, 2*max_lag+1);
+    }
+
+    /**
+     * Correlates the reference frame (frame_size long) against the moving window
+     * (frame_size+2*max_lag long, starting max_lag before the frame it is aligned to).
+     *
+     * returns the correlation for every shift, index 0 is a shift of -max_lag
+     */
+    const Mat & correlator::correlate(const Mat & reference, const Mat & moving){
+        reference.convertTo(reference_buffer.colRange(0, frame_size), CV_64F);
+        reference_buffer.colRange(frame_size, dft_size).setTo(Scalar(0));
+
+        moving.convertTo(moving_buffer.colRange(0, frame_size+2*max_lag), CV_64F);
+        moving_buffer.colRange(frame_size+2*max_lag, dft_size).setTo(Scalar(0));
+
+        dft(reference_buffer, reference_spectrum);
+        dft(moving_buffer, moving_spectrum);
+
+        // moving * conj(reference) is the cross correlation
+        mulSpectrums(moving_spectrum, reference_spectrum, product, 0, true);
+        idft(product, lags, DFT_SCALE | DFT_REAL_OUTPUT);
+
+        return shifts;
+    }
+
+    /**
+     * Turns the command line name into a mode
+     */
+    correlationMode correlator::parseMode(string mode){
+        if(mode=="brute") return CORRELATION_BRUTE;
+        if(mode!="fft") cerr << "Unknown correlation mode " << mode << ", using fft" << endl;
+        return CORRELATION_FFT;
+    }
+
+    /**
+     * Filter applied to the samples before they are corrolated
+     */
+    Mat correlationFilter(const Mat & samples){
+        // Average all the samples to get rid of noise
+        int window = 1; // can filter before corrolating 
+        Mat average_filter = Mat::ones(1,window, CV_32F)/window;
+        average_filter = average_filter.mul(average_filter);
+
+        Mat filtered_samples = Mat::ones(1, samples.cols, CV_32F);
+        filter2D(samples, filtered_samples, -1, average_filter, Point(0,0), 5.0, BORDER_REFLECT);
+
+        return filtered_samples;
+    }
+
+    /**
+     * Finds the shift (from -shift_max to shift_max) of the frame starting at frame_start that lines it
+     * up best with the frame starting at previous_start.
+     */
+    int bestShift(const Mat & filtered_samples, long frame_start, long previous_start, long frame_size,
+                  int shift_max, bool inverted, correlationMode mode){
+        // if the polarization of the reconstruction inverst sample the correlation should be inverted
+        int inverstion_mult = (inverted) ? -1 : 1; 
+
+        double highest_corr = -numeric_limits<double>::max();
+        int best_shift = 0;
+
+        Mat reference = filtered_samples.colRange(previous_start, previous_start+frame_size);
+
+        // the fft window needs shift_max samples on both sides of the frame
+        bool fits = frame_start-shift_max >= 0 && frame_start+frame_size+shift_max < filtered_samples.cols;
+
+        if(mode==CORRELATION_FFT && fits && shift_max < frame_size){
+            // plans and buffers are kept per thread, so they are reused between frames and bands
+            static thread_local correlator fft_correlator;
+            fft_correlator.setup(frame_size, shift_max);
+
+            Mat moving = filtered_samples.colRange(frame_start-shift_max, frame_start+frame_size+shift_max);
+            const Mat & lags = fft_correlator.correlate(reference, moving);
+
+            for(int j=-shift_max; j<=shift_max; j++){
+                double corr = inverstion_mult*lags.at<double>(0, j+shift_max);
+                if(corr > highest_corr){
+                    highest_corr = corr;
+                    best_shift = j;
+                }
+            }
+        }else{
+            for(int j=-shift_max; j<=shift_max; j++){
+                long start = frame_start + j%frame_size;
+                if(start < 0 || start+frame_size >= filtered_samples.cols) continue;
+
+                Mat shifting_frame = filtered_samples.colRange(start, start+frame_size);
+                double corr = inverstion_mult*correlation(shifting_frame, reference);
+                if(corr > highest_corr){
+                    highest_corr = corr;
+                    best_shift = j;
+                }
+            }
+        }
+
+        return best_shift;
+    }
+
+}
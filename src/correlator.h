@@ -0,0 +1,46 @@
+#ifndef _CORRELATOR_H_
+#define _CORRELATOR_H_
+#include <opencv2/core/utility.hpp>
+#include <string>
+
+namespace tmpst{
+
+    // how the frames are lined up with each other
+    enum correlationMode{
+        CORRELATION_BRUTE,  // one dot product per shift (reference implementation)
+        CORRELATION_FFT     // every shift at once with a cross correlation
+    };
+
+    /**
+     * FFT cross correlation of a reference frame against a longer moving window.
+     * The buffers (and opencv's dft setup) are kept between calls, so one correlator
+     * should be reused for every frame pair of the same size.
+     */
+    class correlator{
+    private:
+        int frame_size;     // samples in the reference frame
+        int max_lag;        // largest shift in either direction
+        int dft_size;
+
+        cv::Mat reference_buffer, moving_buffer;
+        cv::Mat reference_spectrum, moving_spectrum, product;
+        cv::Mat lags;
+        cv::Mat shifts;     // the part of lags that is valid
+
+    public:
+        correlator();
+
+        void setup(int frame_size, int max_lag);
+
+        const cv::Mat & correlate(const cv::Mat & reference, const cv::Mat & moving);
+
+        static correlationMode parseMode(std::string mode);
+    };
+
+    cv::Mat correlationFilter(const cv::Mat & samples);
+
+    int bestShift(const cv::Mat & filtered_samples, long frame_start, long previous_start, long frame_size,
+                  int shift_max, bool inverted, correlationMode mode);
+
+}
+#endif
@@ -0,0 +1,192 @@
+#include "daemon.h"
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+
+using namespace std;
+
+namespace tmpst{
+
+    bool daemonJob::parse(string line){
+        settings.clear();
+        istringstream fields(line);
+        string field;
+
+        while(fields >> field){
+            size_t equals = field.find('=');
+            if(equals == string::npos || equals == 0){
+                error = "settings are written key=value, not "+field;
+                return false;
+            }
+            settings[field.substr(0, equals)] = field.substr(equals+1);
+        }
+        return true;
+    }
+
+    bool daemonJob::get(string key, double & value){
+        if(!settings.count(key)) return true;
+        try{
+            size_t used;
+            double parsed = stod(settings[key], &used);
+            if(used != settings[key].size()) throw invalid_argument(key);
+            value = parsed;
+            return true;
+        }catch(exception & e){
+            error = key+" needs a number, not "+settings[key];
+            return false;
+        }
+    }
+
+    bool daemonJob::get(string key, int & value){
+        double parsed = value;
+        if(!get(key, parsed)) return false;
+        if(parsed != int(parsed)){
+            error = key+" needs a whole number, not "+settings[key];
+            return false;
+        }
+        value = int(parsed);
+        return true;
+    }
+
+    void daemonJob::get(string key, string & value){
+        if(settings.count(key)) value = settings[key];
+    }
+
+    // ========================================= SERVER ==========================================
+
+    atomic<bool> daemonServer::running(false);
+
+    daemonServer::daemonServer(string socket_path, function<bool(daemonJob &, string &)> run):
+                                socket_path(socket_path), run(run){}
+
+    daemonServer::~daemonServer(){
+        if(listener >= 0){
+            close(listener);
+            unlink(socket_path.c_str());
+        }
+    }
+
+    void daemonServer::stop(){ running = false; }
+
+    /**
+     * Listens on socket_path, replacing a socket left behind by an earlier daemon.
+     * Only the user running the daemon can connect.
+     */
+    bool daemonServer::open(){
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if(socket_path.empty() || socket_path.size() >= sizeof(address.sun_path)){
+            cerr << "The daemon socket path has to be 1 to " << sizeof(address.sun_path)-1 << " characters" << endl;
+            return false;
+        }
+        strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path)-1);
+
+        struct stat path_stats;
+        if(lstat(socket_path.c_str(), &path_stats) == 0){
+            if(!S_ISSOCK(path_stats.st_mode)){
+                cerr << socket_path << " exists and is not a socket" << endl;
+                return false;
+            }
+            unlink(socket_path.c_str());
+        }
+
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(listener < 0){
+            cerr << "Could not make the daemon socket: " << strerror(errno) << endl;
+            return false;
+        }
+
+        mode_t mask = umask(0077); // the socket is made owner only
+        bool bound = bind(listener, (sockaddr *) &address, sizeof(address)) == 0;
+        umask(mask);
+
+        if(!bound || listen(listener, 4) < 0){
+            cerr << "Could not listen on " << socket_path << ": " << strerror(errno) << endl;
+            close(listener);
+            listener = -1;
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Runs the jobs as they come in until quit or stop (checked a few times a second).
+     */
+    void daemonServer::serve(){
+        running = true;
+        cout << "Waiting for jobs on " << socket_path << endl;
+
+        while(running){
+            pollfd waiting = {listener, POLLIN, 0};
+            int ready = poll(&waiting, 1, 250);
+            if(ready <= 0) continue; // timeout or a signal
+
+            int connection = accept(listener, NULL, NULL);
+            if(connection < 0) continue;
+
+            handle(connection);
+            close(connection);
+        }
+
+        cout << "Daemon stopped" << endl;
+    }
+
+    void daemonServer::handle(int connection){
+        // a client that never finishes its line cannot hold up the daemon
+        timeval timeout = {5, 0};
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        string line;
+        char buffer[512];
+        while(line.find('\n') == string::npos && line.size() < 4096){
+            ssize_t received = recv(connection, buffer, sizeof(buffer), 0);
+            if(received <= 0) break;
+            line.append(buffer, received);
+        }
+        line = line.substr(0, line.find('\n'));
+        if(!line.empty() && line.back() == '\r') line.pop_back();
+
+        daemonJob job;
+        string reply;
+        bool ok;
+
+        if(line == "ping"){
+            ok = true;
+        }else if(line == "quit"){
+            ok = true;
+            reply = "stopping";
+            running = false;
+        }else if(line.empty()){
+            ok = false;
+            reply = "no job, send key=value settings";
+        }else if(!job.parse(line)){
+            ok = false;
+            reply = job.error;
+        }else{
+            cout << "Job: " << line << endl;
+            auto start = chrono::steady_clock::now();
+            try{
+                ok = run(job, reply);
+            }catch(const exception & e){ // a bad job (or a receiver error) must not stop the daemon
+                ok = false;
+                reply = e.what();
+            }
+            cout << "Job " << ((ok) ? "done" : "failed") << " in "
+                 << chrono::duration<double>(chrono::steady_clock::now()-start).count() << "s: " << reply << endl;
+        }
+
+        string answer = ((ok) ? "ok" : "error") + ((reply.empty()) ? "" : " "+reply) + "\n";
+        send(connection, answer.c_str(), answer.size(), MSG_NOSIGNAL); // the client may be gone
+    }
+
+}
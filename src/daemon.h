@@ -0,0 +1,51 @@
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+#include <string>
+#include <map>
+#include <atomic>
+#include <functional>
+
+namespace tmpst{
+
+    /**
+     * One request to the daemon, a line of key=value settings split by spaces, eg
+     *      freq=1.2e9 res=1920x1080 refresh=60 average=4
+     * Settings that are not given keep the command line value.
+     */
+    struct daemonJob{
+        std::map<std::string, std::string> settings;
+        std::string error;          // what the last failed parse or get was about
+
+        bool parse(std::string line);
+        bool get(std::string key, double & value);      // leaves value when not given, false when not a number
+        bool get(std::string key, int & value);
+        void get(std::string key, std::string & value);
+    };
+
+    /**
+     * Takes jobs from a local unix socket one connection at a time, so the receiver only gets set up once.
+     * A connection sends one line and gets one back: "ok <reply>" or "error <reply>".
+     * The line "ping" only answers, "quit" stops the daemon.
+     */
+    class daemonServer{
+    private:
+        std::string socket_path;
+        int listener = -1;
+        std::function<bool(daemonJob &, std::string &)> run;
+
+        static std::atomic<bool> running;   // cleared to stop serving
+
+        void handle(int connection);
+
+    public:
+        daemonServer(std::string socket_path, std::function<bool(daemonJob &, std::string &)> run);
+        ~daemonServer();
+
+        bool open();
+        void serve();
+
+        static void stop();
+    };
+
+}
+#endif
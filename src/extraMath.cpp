@@ -1,5 +1,7 @@
 #include "extraMath.h"
+#include "kernels.h"
 #include <iostream>
+#include <map>
 #include <opencv2/core/utility.hpp>
 
 using namespace cv;
@@ -20,11 +22,26 @@ namespace tmpst{
                 );
         */
 
+        // raw samples go through the widening kernel (mul saturates 16 bit products)
+        if(one.type()==CV_16U && two.type()==CV_16U && one.rows==1 && two.rows==1 && one.cols==two.cols)
+            return double(kernels::dot(one.ptr<unsigned short>(0), two.ptr<unsigned short>(0), one.cols));
+
         double answer = sum(one.mul(two))[0];
 
         return answer;
     }
 
+    /**
+     * Fits a parabola through three samples around a peak.
+     * returns how far the real peak is from the centre sample (-0.5 to 0.5)
+     */
+    double parabolicPeak(double left, double centre, double right){
+        double curve = left - 2*centre + right;
+        if(curve >= 0) return 0; // not a peak
+
+        return 0.5*(left-right)/curve;
+    }
+
     /**
      * shifts the image a certain amount left and right
      */
@@ -65,16 +82,51 @@ namespace tmpst{
 
     }
 
+    /**
+     * Signal to noise estimate of an image (0 is pure noise).
+     * Neighbouring pixels in a line share the picture but not the noise, so half the mean squared
+     * difference between them is the noise power and whatever is left of the variance is picture.
+     */
+    double imageQuality(const cv::Mat & image){
+        if(image.empty() || image.cols < 2) return 0;
+
+        Mat values;
+        image.convertTo(values, CV_64F);
+
+        double total = 0, total_squared = 0, difference = 0;
+        for(int y=0; y<values.rows; y++){
+            const double * row = values.ptr<double>(y);
+            for(int x=0; x<values.cols; x++){
+                total += row[x];
+                total_squared += row[x]*row[x];
+                if(x > 0) difference += (row[x]-row[x-1])*(row[x]-row[x-1]);
+            }
+        }
 
+        double count = double(values.rows)*values.cols;
+        double variance = total_squared/count - (total/count)*(total/count);
+        double noise = difference/(2.0*values.rows*(values.cols-1));
+
+        if(noise <= 0) return (variance > 0) ? 1e6 : 0;
+        return max(0.0, variance-noise)/noise;
+    }
+
+    /**
+     * Most common shift in the map.
+     * Goes through the shifts in order and ties go to the smallest shift, so the answer does
+     * not depend on the order the map was filled in (ie the amount of threads).
+     */
     pair<int,unsigned int> mapMode(std::unordered_map<int, unsigned int> map){
         int max_index = 0;
         unsigned int max_value = 0;
 
-        auto begin = map.begin(), end = map.end();
+        std::map<int, unsigned int> ordered(map.begin(), map.end());
+        auto begin = ordered.begin(), end = ordered.end();
 
         while(begin!=end){
             cout << "shift: " << begin->first << " has " << begin->second << endl;
-            if(begin->second > max_value){
+            if(begin->second > max_value || 
+                    (begin->second == max_value && abs(begin->first) < abs(max_index))){
                 
                 max_index = begin->first;
                 max_value = begin->second;
@@ -5,7 +5,9 @@
 
 namespace tmpst{
     double correlation(const cv::Mat & one, const cv::Mat & two);
+    double parabolicPeak(double left, double centre, double right);
     void shiftImage(cv::Mat image_in, cv::Mat & image_out, int x, int y); 
+    double imageQuality(const cv::Mat & image);
 
     std::pair<int,unsigned int> mapMode(std::unordered_map<int, unsigned int> map);
 
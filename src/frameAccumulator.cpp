@@ -0,0 +1,135 @@
+#include "frameAccumulator.h"
+#include "extraMath.h"
+#include "kernels.h"
+#include <opencv2/core/utility.hpp>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+namespace tmpst{
+
+    frameAccumulator::frameAccumulator(): pixels_per_image(0), frame_average(0), received(0), peak_window(0) {};
+
+    frameAccumulator::frameAccumulator( long pixels_per_image, int frame_average, int shift_max,
+                                        int calibration_frames, bool inverted, correlationMode mode):
+
+                                        pixels_per_image(pixels_per_image),
+                                        frame_average(frame_average),
+                                        shift_max(shift_max),
+                                        calibration_frames(min(max(calibration_frames, 2), frame_average)),
+                                        inverted(inverted),
+                                        correlation_mode(mode),
+                                        window_start(0), received(0), peak_window(0),
+                                        calibrated(false), shift(0),
+                                        frames_folded(0), frames_tracked(1){
+
+        sum_frames = Mat::zeros(1, pixels_per_image, CV_32F);
+    }
+
+    /**
+     * Same as averageFrames reads: all the frames plus one extra used in shifting
+     */
+    long frameAccumulator::samplesNeeded(){ return pixels_per_image*(frame_average+1); }
+
+    bool frameAccumulator::done(){ return frames_folded == frame_average; }
+    size_t frameAccumulator::peakSamples(){ return peak_window; }
+    int frameAccumulator::getShift(){ return shift; }
+    unordered_map<int, unsigned int> frameAccumulator::getShiftMap(){ return shift_map; }
+
+    /**
+     * Same length createFinalFrame works out from the shifted indices
+     */
+    long frameAccumulator::getPixelsPerImage(){ return frameStart(1) - frameStart(0); }
+
+    /**
+     * Where frame starts once it is shifted (same as shiftIndex in frameStream)
+     */
+    long frameAccumulator::frameStart(int frame){
+        return pixels_per_image*frame + (long(shift)*frame)%pixels_per_image;
+    }
+
+    /**
+     * Adds the next samples, frames are folded in as soon as they are complete
+     */
+    void frameAccumulator::push(const unsigned short * samples, size_t count){
+        // nothing past what averageFrames would have read
+        long room = samplesNeeded() - received;
+        if(room <= 0) return;
+        count = min(count, size_t(room));
+
+        window.insert(window.end(), samples, samples+count);
+        received += count;
+        peak_window = max(peak_window, window.size());
+
+        if(!calibrated){
+            if(received < pixels_per_image*(calibration_frames+1)) return;
+            calibrate();
+        }
+
+        fold();
+
+        // drop the samples no frame (or look back) needs anymore
+        long keep_from = max(0L, min(pixels_per_image*(frames_folded-1), frameStart(frames_folded)));
+        if(keep_from-window_start > pixels_per_image){
+            window.erase(window.begin(), window.begin()+(keep_from-window_start));
+            window_start = keep_from;
+        }
+    }
+
+    /**
+     * Finds the shift from the first frames, like corrolateFrames does on all of them
+     */
+    void frameAccumulator::calibrate(){
+        Mat samples(1, window.size(), CV_16U, window.data());
+        Mat filtered_samples = correlationFilter(samples);
+
+        for(int i=1; i<calibration_frames; i++)
+            shift_map[bestShift(filtered_samples, pixels_per_image*i, pixels_per_image*(i-1), pixels_per_image,
+                                shift_max, inverted, correlation_mode)]++;
+        frames_tracked = calibration_frames;
+
+        shift = (frame_average==1) ? 0 : mapMode(shift_map).first;
+        calibrated = true;
+    }
+
+    /**
+     * Folds every complete frame into the sum.
+     * The frames after calibration still get their shift counted (against the frame before) for reporting.
+     */
+    void frameAccumulator::fold(){
+        while(frames_folded < frame_average){
+            int frame = frames_folded;
+            long start = frameStart(frame);
+            long needed = start+pixels_per_image;
+
+            bool track = frame >= frames_tracked;
+            if(track) needed = max(needed, pixels_per_image*(frame+1)+shift_max+1);
+
+            if(needed > received) break;
+
+            if(track){
+                // previous frame, this frame and shift_max past it
+                long look_back = pixels_per_image*(frame-1);
+                Mat samples(1, pixels_per_image*2+shift_max+1, CV_16U, &window[look_back-window_start]);
+                Mat filtered_samples = correlationFilter(samples);
+
+                shift_map[bestShift(filtered_samples, pixels_per_image, 0, pixels_per_image,
+                                    shift_max, inverted, correlation_mode)]++;
+                frames_tracked++;
+            }
+
+            kernels::accumulate(&window[start-window_start], sum_frames.ptr<float>(0), pixels_per_image, 1.0f/frame_average);
+            frames_folded++;
+        }
+    }
+
+    /**
+     * The averaged frame, scaled the same as averageFrames
+     */
+    Mat frameAccumulator::average(){
+        Mat result = sum_frames/frame_average;
+        return result;
+    }
+
+}
@@ -0,0 +1,62 @@
+#ifndef _FRAMEACCUMULATOR_H_
+#define _FRAMEACCUMULATOR_H_
+#include <opencv2/core/utility.hpp>
+#include <vector>
+#include <unordered_map>
+#include "correlator.h"
+
+namespace tmpst{
+
+    /**
+     * Averages frames as their samples arrive instead of keeping every frame in memory.
+     * The first calibration frames are kept to find the shift (the same search corrolateFrames does),
+     * after that every frame is folded into a running sum and only a two frame look back window is kept.
+     * If the calibration finds the same shift as the whole capture would, the average is the same one
+     * averageFrames makes.
+     */
+    class frameAccumulator{
+    private:
+        long pixels_per_image;
+        int frame_average;
+        int shift_max;
+        int calibration_frames;
+        bool inverted;
+        correlationMode correlation_mode;
+
+        std::vector<unsigned short> window;     // samples still needed, window[0] is sample window_start
+        long window_start;
+        long received;                          // total samples pushed so far
+        size_t peak_window;
+
+        bool calibrated;
+        int shift;                              // per frame shift found while calibrating
+        int frames_folded;
+        int frames_tracked;                     // frames whose shift to the frame before has been counted
+        std::unordered_map<int, unsigned int> shift_map;
+
+        cv::Mat sum_frames;
+
+        long frameStart(int frame);
+        void calibrate();
+        void fold();
+
+    public:
+        frameAccumulator();
+        frameAccumulator(long pixels_per_image, int frame_average, int shift_max, int calibration_frames,
+                         bool inverted, correlationMode mode);
+
+        void push(const unsigned short * samples, size_t count);
+
+        bool done();
+        long samplesNeeded();
+        size_t peakSamples();
+
+        int getShift();
+        long getPixelsPerImage();
+        std::unordered_map<int, unsigned int> getShiftMap();
+
+        cv::Mat average();
+    };
+
+}
+#endif
@@ -5,10 +5,23 @@
 #include <opencv2/opencv.hpp>
 #include <uhd/usrp/multi_usrp.hpp>
 #include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <iterator>
 #include <climits>
 #include <vector>
 #include "omp.h"
+#include "kernels.h"
+#include "resampler.h"
+#include "sampleArena.h"
+#include "trace.h"
+#include "rasterizer.h"
+#include "imageWriter.h"
+#include "boundedQueue.h"
+#include <thread>
+#include <iomanip>
 #include <functional>
 
 using namespace cv;
@@ -45,7 +58,6 @@ namespace tmpst{
         int sample_size = pixels_per_image*(frame_average+1); // +1 for extra frame
         if(verbose) cout << "Samples to read in: " << sample_size << endl;
 
-        all_samples = Mat::zeros(1,sample_size, CV_16U);
         indices = vector<int>(frame_average);
 
         total_sample_count = pixels_per_image*frame_average;
@@ -53,39 +65,181 @@ namespace tmpst{
     }
 
     double frameStream::getFrequency(){ return frequency; }
+    void frameStream::setCorrelationMode(correlationMode mode){ correlation_mode = mode; }
+    void frameStream::setFractional(bool fractional){ this->fractional = fractional; }
+    void frameStream::setAveraging(averageMode mode, double trim, double reject){
+        average_mode = mode;
+        trim_fraction = trim;
+        reject_threshold = reject;
+    }
+
+    /**
+     * Frames get folded into a running average as they are loaded, so all_samples is never needed.
+     * Call after the correlation mode is set.
+     */
+    void frameStream::setStreaming(int calibration_frames, int shift_max){
+        streaming = true;
+        all_samples.release();
+        accumulator = frameAccumulator(pixels_per_image, frame_average, shift_max, calibration_frames, inverted, correlation_mode);
+    }
+
+    /**
+     * all_samples is only made when data gets loaded (not in streaming mode)
+     */
+    void frameStream::allocateSamples(){
+        if(all_samples.empty()) all_samples = Mat::zeros(1, pixels_per_image*(frame_average+1), CV_16U); // +1 for extra frame
+    }
+    /**
+     * Loads the samples into buffer (grown when it is too small) instead of a fresh allocation,
+     * so a batch worker keeps one sample buffer from capture to capture.
+     */
+    void frameStream::useSampleBuffer(Mat & buffer){
+        if(streaming) return; // no all_samples to hold
+        int needed = pixels_per_image*(frame_average+1); // +1 for extra frame
+        if(buffer.cols < needed) buffer.create(1, needed, CV_16U);
+
+        all_samples = buffer.colRange(0, needed); // loading overwrites all of it
+    }
     Mat frameStream::getFinalImage(){ return final_image; }
+    const Mat & frameStream::getSamples(){ return all_samples; }
+    Mat frameStream::getMiniImage(){ return final_mini_image; }
+
+    /**
+     * Memory the band holds for its samples between loading and createFinalFrame.
+     * When streaming that is the running sum and the (about three frame) look back window.
+     */
+    size_t frameStream::sampleBytes(){
+        if(streaming) return pixels_per_image*(sizeof(float) + 3*sizeof(unsigned short));
+        return pixels_per_image*(frame_average+1)*sizeof(unsigned short);
+    }
+
+    /**
+     * Writes all_samples to the output directory and frees it, for bands that have been processed
+     * but still wait on the other bands before createFinalFrame.
+     */
+    bool frameStream::spillSamples(){
+        if(streaming || all_samples.empty()) return true;
+
+        string filename = output_directory+"samples-"+to_string(frequency)+".raw";
+        ofstream spill(filename, ios::binary);
+        spill.write((const char *) all_samples.ptr<unsigned short>(0), all_samples.cols*sizeof(unsigned short));
+
+        if(!spill){
+            cerr << "Could not spill samples to " << filename << ", keeping them in memory" << endl;
+            remove(filename.c_str());
+            return false;
+        }
+
+        spill_file = filename;
+        all_samples.release();
+        return true;
+    }
+
+    /**
+     * Reads back samples written by spillSamples
+     */
+    bool frameStream::restoreSamples(){
+        if(spill_file.empty()) return true;
+
+        allocateSamples();
+        ifstream spill(spill_file, ios::binary);
+        spill.read((char *) all_samples.ptr<unsigned short>(0), all_samples.cols*sizeof(unsigned short));
+
+        if(!spill){
+            cerr << "Could not read spilled samples back from " << spill_file << endl;
+            return false;
+        }
+
+        remove(spill_file.c_str());
+        spill_file.clear();
+        return true;
+    }
     // ===================================================================================
     // =============================== LOADING DATA ======================================
     // ===================================================================================
 
     /**
-     * Loads in frame data from a binary file
+     * Loads in frame data from a binary file.
+     * The file is memory mapped, the ignored frames are skipped over and the
+     * IQ samples are converted to magnitudes in blocks.
      */
     bool frameStream::loadDataFile(string filename, int frame_ignore){
+        TRACE_SCOPE("load", frequency);
         if(verbose) cout << filename << endl;
+        if(!streaming) allocateSamples();
         //reading in file
-        ifstream input_stream(filename.c_str(), ios::binary);
-
-        input_stream.seekg(pixels_per_image*frame_ignore*2*2, std::ios::cur);
-
-        short I_sample, Q_sample;
-        int counter = 0;
-        while(counter<pixels_per_image*(frame_average+1) &&  // + 1 is for the extra frame used in shifting
-                input_stream.read((char *)&I_sample, sizeof(short)) &&
-                input_stream.read((char *)&Q_sample, sizeof(short))){
-            
-            all_samples.at<short>(0,counter++) = sqrt(pow(I_sample,2)+pow(Q_sample,2));
-            //all_samples.at<short>(0,counter++) = I_sample+Q_sample;//sqrt(pow(I_sample,2)+pow(Q_sample,2));
-
-            if(input_stream.peek() == EOF){
-                cout << "Input file not long enough for current average frame amount/sample rate" << endl;
-                cout << "Try decreasing your --average." << endl;
-                cout << "This can happen because you need to record one more frame than you can use (for shifting purposes" << endl;
-                return false;
+        int file_descriptor = open(filename.c_str(), O_RDONLY);
+        if(file_descriptor < 0){
+            cerr << "Could not open input file: " << filename << endl;
+            return false;
+        }
+
+        struct stat file_stats;
+        if(fstat(file_descriptor, &file_stats) < 0){
+            cerr << "Could not read the size of input file: " << filename << endl;
+            close(file_descriptor);
+            return false;
+        }
+
+        size_t sample_bytes = 2*sizeof(short); // one I and one Q sample
+        size_t ignore_samples = size_t(pixels_per_image)*frame_ignore;
+        size_t read_samples = size_t(pixels_per_image)*(frame_average+1); // + 1 is for the extra frame used in shifting
+        size_t file_samples = size_t(file_stats.st_size)/sample_bytes;
+
+        // check the length once up front
+        if(file_samples < ignore_samples+read_samples){
+            cout << "Input file not long enough for current average frame amount/sample rate" << endl;
+            cout << "File has " << file_samples << " samples, but " << ignore_samples+read_samples << " are needed." << endl;
+            cout << "Try decreasing your --average." << endl;
+            cout << "This can happen because you need to record one more frame than you can use (for shifting purposes" << endl;
+            close(file_descriptor);
+            return false;
+        }
+
+        void * mapped = mmap(NULL, file_stats.st_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+        close(file_descriptor); // mapping stays valid after closing
+        if(mapped == MAP_FAILED){
+            cerr << "Could not memory map input file: " << filename << endl;
+            return false;
+        }
+        madvise(mapped, file_stats.st_size, MADV_SEQUENTIAL);
+
+        // skip the ignored frames
+        const short * iq_samples = (const short *) mapped + 2*ignore_samples;
+
+        // convert the mapped samples in large blocks
+        const long block_size = 1<<16;
+        long block_count = (read_samples+block_size-1)/block_size;
+
+        if(streaming){
+            // one block at a time, in order, straight into the accumulator
+            vector<unsigned short> magnitudes(block_size);
+            for(long block=0; block<block_count; block++){
+                size_t start = block*block_size;
+                size_t end = min(start+block_size, read_samples);
+
+                {
+                    TRACE_SCOPE("magnitude", frequency);
+                    kernels::magnitude(iq_samples+2*start, &magnitudes.front(), end-start);
+                }
+                accumulator.push(&magnitudes.front(), end-start);
+            }
+            if(verbose) cout << "Peak samples held: " << accumulator.peakSamples() << endl;
+
+        }else{
+            unsigned short * magnitudes = all_samples.ptr<unsigned short>(0);
+            TRACE_SCOPE("magnitude", frequency);
+
+#pragma omp parallel for
+            for(long block=0; block<block_count; block++){
+                size_t start = block*block_size;
+                size_t end = min(start+block_size, read_samples);
+
+                kernels::magnitude(iq_samples+2*start, magnitudes+start, end-start);
             }
         }
 
-        input_stream.close();
+        munmap(mapped, file_stats.st_size);
 
         return true;
     }
@@ -95,73 +249,134 @@ namespace tmpst{
      */
     bool frameStream::loadDataRx(uhd::usrp::multi_usrp::sptr usrp, double offset, size_t channel, int frame_ignore){
         if(verbose) cout << "Scanning frequency: " << frequency/1000000 << "MHz" << endl;
-        uhd::tune_request_t tune_request(frequency, offset);
-        usrp->set_rx_freq(tune_request, channel);
+
+        uhdSource source(usrp, channel, 0.0);
+        source.tune(frequency, offset, -1);
 
         long sample_size = pixels_per_image*(frame_average+frame_ignore+1); // total number of samples to take (include one extra)
+        source.stream(sample_size, -1);
 
-        uhd::stream_args_t stream_arguments("sc16","sc16"); //setting both to complex shorts for efficiency
+        bool received = loadDataSource(source, frame_ignore);
 
-        // setting up channels
-        vector<size_t> channels;
-        channels.push_back(channel);
-        stream_arguments.channels = channels;
+        // stop streaming
+        source.stop();
 
-        // get receiver stream obj
-        uhd::rx_streamer::sptr receiver_stream = usrp->get_rx_stream(stream_arguments);
+        return received;
+    }
 
-        uhd::rx_metadata_t meta_data;
+    /**
+     * Receives a burst that has already been started on source
+     * (pixels_per_image*(frame_average+frame_ignore+1) samples, see loadDataRx and the sweep scheduler in tempest).
+     */
+    bool frameStream::loadDataSource(sampleSource & source, int frame_ignore){
+        TRACE_SCOPE("rx", frequency);
+        if(!streaming) allocateSamples();
+
+        long sample_size = pixels_per_image*(frame_average+frame_ignore+1); // total number of samples to take (include one extra)
+        long ignore_samples = pixels_per_image*frame_ignore;
+
+        // received straight into one slot while the slot before is turned into magnitudes,
+        // the arena is kept by the receiving thread for every band
+        static thread_local sampleArena arena(1<<18, 2);
+        vector<unsigned short> chunk_magnitudes((streaming) ? arena.slotSize() : 0);
+
+        /**
+         * Converts a received slot (first is its position in the burst).
+         * Ignored frames are dropped here without ever being stored.
+         */
+        auto convert = [this, ignore_samples, &chunk_magnitudes](const complex<short> * iq, long first, long count){
+            long skip = max(0L, min(ignore_samples-first, count));
+            if(skip == count) return;
+            TRACE_SCOPE("magnitude", frequency);
+
+            if(streaming){
+                kernels::magnitude((const short *) (iq+skip), &chunk_magnitudes.front(), count-skip);
+                accumulator.push(&chunk_magnitudes.front(), count-skip);
+            }else{
+                long offset = first+skip-ignore_samples;
+                kernels::magnitude((const short *) (iq+skip), all_samples.ptr<unsigned short>(0)+offset, count-skip);
+            }
+        };
 
-        //create receiver buffer
-        vector<complex<short>> buffer(sample_size);
+        // one converter thread for the whole burst: slots go to it full and come back free
+        struct filledSlot{ int slot; long first, count; };
+        boundedQueue<filledSlot> filled(2);
+        boundedQueue<int> free_slots(2);
+        free_slots.push(0);
+        free_slots.push(1);
+
+        thread converter([&](){
+            filledSlot done;
+            while(filled.pop(done)){
+                convert(arena.slot(done.slot), done.first, done.count);
+                free_slots.push(done.slot);
+            }
+        });
 
-        // setup the actual streaming
-        uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_DONE);
-        stream_cmd.num_samps    = size_t(sample_size);
-        stream_cmd.stream_now   = true;
-        stream_cmd.time_spec    = uhd::time_spec_t();
-        receiver_stream->issue_stream_cmd(stream_cmd);
+        int slot;
+        free_slots.pop(slot);
+        long slot_start = 0;
+        long slot_filled = 0;
 
+        uhd::rx_metadata_t meta_data;
 
         // run until buffer is filled
         long received_samps = 0;
-        while (received_samps!=sample_size){ // streaming
+        while (received_samps<sample_size){ // streaming
 
-            size_t num_rx_samps = receiver_stream->recv(&buffer.front(), buffer.size(), meta_data, 3.0, false);
+            long wanted = min(long(arena.slotSize())-slot_filled, sample_size-received_samps);
+            size_t num_rx_samps = source.recv(arena.slot(slot)+slot_filled, wanted, meta_data, 3.0);
 
             // receiver error handeling
-            if(meta_data.error_code == uhd::rx_metadata_t::ERROR_CODE_TIMEOUT){
-                cout << "Time out while receiving!" << endl;
-                return false;
-            }else if(meta_data.error_code == uhd::rx_metadata_t::ERROR_CODE_OVERFLOW){
-                cout << "Receiver overflow!" << endl;
-                return false;
-            }else if(meta_data.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE){
-                cerr << "Unknown receiver error: " << meta_data.strerror() << endl;
+            if(meta_data.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE){
+                filled.close();
+                converter.join();
+
+                if(meta_data.error_code == uhd::rx_metadata_t::ERROR_CODE_TIMEOUT){
+                    cout << "Time out while receiving!" << endl;
+                }else if(meta_data.error_code == uhd::rx_metadata_t::ERROR_CODE_OVERFLOW){
+                    cout << "Receiver overflow!" << endl;
+                }else if(meta_data.error_code == uhd::rx_metadata_t::ERROR_CODE_LATE_COMMAND){
+                    cout << "Receiver got the stream command too late!" << endl;
+                }else{
+                    cerr << "Unknown receiver error: " << meta_data.strerror() << endl;
+                }
                 return false;
             }
 
+            slot_filled += num_rx_samps;
             received_samps += num_rx_samps;
-        }
 
-        // stop streaming
-        stream_cmd.stream_mode = uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS;
-        receiver_stream->issue_stream_cmd(stream_cmd);
+            // slot is full, convert it while the other one is received into
+            if(slot_filled == long(arena.slotSize()) || received_samps == sample_size){
+                filled.push(filledSlot{slot, slot_start, slot_filled});
+                if(received_samps < sample_size) free_slots.pop(slot);
+
+                slot_start = received_samps;
+                slot_filled = 0;
+            }
+        }
 
+        filled.close();
+        converter.join();
 
-        // put all streamed data into IQ samples and save to all_samples
-        if(verbose) cout << "Received samples: " << buffer.size() << endl;
+        if(verbose) cout << "Received samples: " << received_samps << endl;
         if(verbose) cout << "Saved samples: " << pixels_per_image*frame_average << endl;
-
-        for(unsigned int i=0; i<pixels_per_image*(frame_average+1); i++){ // +1 for extra frame
-            short sample = abs(buffer[pixels_per_image*frame_ignore + i]);
-            all_samples.at<short>(0,i) = sample;
-        }
+        if(streaming && verbose) cout << "Peak samples held: " << accumulator.peakSamples() << endl;
 
         return true;
 
     }
 
+    /**
+     * Takes the newest magnitudes out of a ring buffer (live mode).
+     * end is set to the sample count of the ring at the end of the copied samples.
+     */
+    bool frameStream::loadDataRing(const ringBuffer<unsigned short> & ring, uint64_t & end){
+        allocateSamples();
+        return ring.copyLatest(all_samples.ptr<unsigned short>(0), all_samples.cols, end);
+    }
+
     // ===================================================================================
     // ============================== SAMPLE PROCESSORS ==================================
     // ===================================================================================
@@ -176,18 +391,23 @@ namespace tmpst{
      */
     pair<int, unsigned int> frameStream::processSamples(int shift_max){
 
+        if(streaming){
+            // frames were already corrolated while they were folded in
+            if(!accumulator.done()) cerr << "Not all frames were loaded into the running average" << endl;
+
+            TRACE_SCOPE("mode", frequency);
+            if(frame_average==1)
+                return make_pair(0,1);
+            else
+                return mapMode(accumulator.getShiftMap());
+        }
+
         for(int i=0; i<frame_average; i++){
             indices[i] = pixels_per_image*i;
 
             // Save all frames
             if(verbose){
-                Mat one_frame = makeMatrix(indices[i], all_samples);
-                Mat stretch = Mat(1,width*height, CV_16U);
-                resize(one_frame, stretch, Size(width*height,1));
-                final_image = Mat::zeros(height, width, CV_8U);
-                final_image = stretch.reshape(0,height);
-                normalize(final_image, final_image, 0, 255, NORM_MINMAX, CV_8UC1);
-
+                rasterize(makeMatrix(indices[i], all_samples), final_image, width, height, false);
                 saveImage(to_string(i)+"-before_shift");
                 final_image.release();
             }
@@ -196,8 +416,10 @@ namespace tmpst{
         //corrolate frames
         if(frame_average==1)
             return make_pair(0,1);
-        else
-            return mapMode(corrolateFrames(shift_max));
+
+        unordered_map<int, unsigned int> shift_map = corrolateFrames(shift_max);
+        TRACE_SCOPE("mode", frequency);
+        return mapMode(shift_map);
     }
 
     /**
@@ -236,14 +458,11 @@ namespace tmpst{
      * corrolates the frames to that they line up (miss align due to error in refresh rate)
      */
     unordered_map<int, unsigned int> frameStream::corrolateFrames(int shift_max){
-        // Average all the samples to get rid of noise
-        int window = 1; // can filter before corrolating 
-        Mat average_filter = Mat::ones(1,window, CV_32F)/window;
-        average_filter = average_filter.mul(average_filter);
-
-        
-        Mat filtered_samples = Mat::ones(1, all_samples.cols, CV_32F);
-        filter2D(all_samples, filtered_samples, -1, average_filter, Point(0,0), 5.0, BORDER_REFLECT);
+        Mat filtered_samples;
+        {
+            TRACE_SCOPE("filter", frequency);
+            filtered_samples = correlationFilter(all_samples);
+        }
 
         if(verbose) cout << "sizes of samples: " << all_samples.cols << ", " << filtered_samples.cols << endl;
 
@@ -251,46 +470,35 @@ namespace tmpst{
         unordered_map<int, unsigned int> shift_amount_map; // cant be ordered because constantly changing
 
         //calculate the best shifts (first frame does not shift)
+        vector<int> best_shifts(frame_average, 0);
 
-        //uncompent both #pragma to enable omp threads for this
-//#pragma omp parallel for
-        for(int i=frame_average-1; i>=1; i--){
-
-            // if the polarization of the reconstruction inverst sample the correlation should be inverted
-            int inverstion_mult = (inverted) ? -1 : 1; 
+        // every thread counts its own shifts, the counts are merged once the frames are done
+#pragma omp parallel
+        {
+            unordered_map<int, unsigned int> thread_shift_map;
 
-            double highest_corr = -numeric_limits<double>::max();
-            int best_shift = 0;
-
-            for(int j=-shift_max; j<=shift_max; j++){
-                Mat shifting_frame = makeMatrix(shiftIndex(indices[i],j), filtered_samples);
-                double corr = inverstion_mult*correlation(shifting_frame, makeMatrix(indices[i-1], filtered_samples));
-                if(corr > highest_corr){
-                    highest_corr = corr;
-                    best_shift = j;
-                }
+#pragma omp for schedule(dynamic)
+            for(int i=1; i<frame_average; i++){
+                TRACE_SCOPE("correlation", frequency, i);
+                best_shifts[i] = bestShift(filtered_samples, indices[i], indices[i-1], pixels_per_image,
+                                           shift_max, inverted, correlation_mode);
+                thread_shift_map[best_shifts[i]]++;
             }
 
-//#pragma omp critical
-            {
-
-            shift_amount_map[best_shift]++;
+#pragma omp critical
+            for(auto & shift : thread_shift_map)
+                shift_amount_map[shift.first] += shift.second;
+        }
 
+        // outside the parallel region so disk writes never hold up the search
+        for(int i=frame_average-1; i>=1; i--){
             if(verbose){ // save frames after shifts
-                Mat one_frame = makeMatrix(shiftIndex(indices[i],best_shift*i), all_samples);
-                Mat stretch = Mat(1,width*height, CV_16U);
-                resize(one_frame, stretch, Size(width*height,1));
-                final_image = Mat::zeros(height, width, CV_8U);
-                final_image = stretch.reshape(0,height);
-                normalize(final_image, final_image, 0, 255, NORM_MINMAX, CV_8UC1);
-
+                rasterize(makeMatrix(shiftIndex(indices[i],best_shifts[i]*i), all_samples), final_image, width, height, false);
                 saveImage(to_string(i)+"-after_shift");
                 final_image.release();
             }
 
-            }
-
-            if(verbose) cout << i << "\t" << best_shift << endl;
+            if(verbose) cout << i << "\t" << best_shifts[i] << endl;
         }
 
         return shift_amount_map;
@@ -303,53 +511,101 @@ namespace tmpst{
      * !!NOTE: pixels_per_image CHANGES AFTER THIS IS RUN (straigtens image out)
      */
     void frameStream::createFinalFrame(int shift_amount){
-        //shift frame
-        if(frame_average!=1){
+        Mat one_frame;
+        restoreSamples();
 
-            int total_shift = 0;
-            for(int i=1; i<frame_average; i++){
-                total_shift += shift_amount;
+        if(streaming){
+            // already averaged while loading, with the shift found during calibration
+            if(shift_amount != accumulator.getShift())
+                cout << "Running average used shift " << accumulator.getShift() << " instead of " << shift_amount << endl;
 
-                indices[i] = shiftIndex(indices[i], total_shift);
-            }
+            TRACE_SCOPE("average", frequency);
+            one_frame = accumulator.average();
 
-            //align frame
             if(verbose) cout << endl << "ppi before: " << pixels_per_image << endl;
-            pixels_per_image = indices[1] - indices[0]; // SO BIG BRAIN
+            pixels_per_image = accumulator.getPixelsPerImage();
             if(verbose) cout << "ppi after: " << pixels_per_image << endl;
-        }
 
-        // average frames
-        Mat one_frame = averageFrames(indices);
+        }else if(fractional && frame_average!=1){
+            // measure the real frame length and resample every frame onto it
+            {
+                TRACE_SCOPE("period", frequency);
+                frame_period = estimatePeriod(shift_amount);
+            }
+            if(verbose) cout << endl << "Measured frame period: " << setprecision(12) << frame_period 
+                             << " samples (" << sample_rate/frame_period << "Hz)" << endl;
+
+            one_frame = averageFramesFractional(frame_period);
 
-        float multiplier = writeMiniFrame(one_frame);
+            if(verbose) cout << "ppi before: " << pixels_per_image << endl;
+            pixels_per_image = one_frame.cols;
+            if(verbose) cout << "ppi after: " << pixels_per_image << endl;
+
+        }else{
+            //shift frame
+            if(frame_average!=1){
+
+                int total_shift = 0;
+                for(int i=1; i<frame_average; i++){
+                    total_shift += shift_amount;
+
+                    indices[i] = shiftIndex(indices[i], total_shift);
+                }
+
+                //align frame
+                if(verbose) cout << endl << "ppi before: " << pixels_per_image << endl;
+                pixels_per_image = indices[1] - indices[0]; // SO BIG BRAIN
+                if(verbose) cout << "ppi after: " << pixels_per_image << endl;
+            }
+
+            // average frames
+            TRACE_SCOPE("average", frequency);
+            one_frame = averageFrames(indices);
+        }
 
         //clear memory of all samples as it isnt needed
         all_samples.release();
 
-        // stretch image to fit into final matrix resolution
-        Mat stretch = Mat(1,width*height, CV_16U);
-        resize(one_frame, stretch, Size(width*height,1)); // interpolates samples
+        average_frame = one_frame;
+        used_shift = (streaming) ? accumulator.getShift() : shift_amount;
+        drawFinalFrame();
+    }
 
-        final_image = Mat::zeros(height, width, CV_8U);
+    /**
+     * Loads an averaged frame made earlier (see bandCache) in place of loading and processing samples
+     */
+    void frameStream::loadAverage(const Mat & frame, int shift_amount){
+        average_frame = frame;
+        used_shift = shift_amount;
+        pixels_per_image = frame.cols;
+        drawFinalFrame();
+    }
 
-        final_image = stretch.reshape(0,height); // reshapes array into 2D image
+    Mat frameStream::getAverageFrame(){ return average_frame; }
+    int frameStream::getShift(){ return used_shift; }
 
-        // normalize frame to usigned char
-        normalize(final_image, final_image, 0, 255, NORM_MINMAX, CV_8UC1);
+    /**
+     * Turns average_frame into the centered final_image
+     */
+    void frameStream::drawFinalFrame(){
+        Mat & one_frame = average_frame;
+        float multiplier = writeMiniFrame(one_frame);
 
-        if(interlaced){
-            // compensate for interlaced display
-            final_image = reconInterlace(final_image.clone()); 
-            final_mini_image = reconInterlace(final_mini_image.clone()); 
+        if(verbose){
+            rasterize(one_frame, final_image, width, height, interlaced);
+            saveImage("uncenterd_image-"+to_string(getFrequency()));
         }
 
-        if(verbose) saveImage("uncenterd_image-"+to_string(getFrequency()));
-
         // Center image
-        pair<int, int> amount = centerImage(final_mini_image); // finds shifts to center mini frame
+        pair<int, int> amount;
+        {
+            TRACE_SCOPE("center", frequency);
+            amount = centerImage(final_mini_image); // finds shifts to center mini frame
+        }
 
-        shiftImage(final_image.clone(), final_image, -amount.first*multiplier, -amount.second*multiplier);
+        // stretch, normalize, deinterlace and center in one go
+        TRACE_SCOPE("rasterize", frequency);
+        rasterize(one_frame, final_image, width, height, interlaced, -amount.first*multiplier, -amount.second*multiplier);
 
     }
 
@@ -360,13 +616,211 @@ namespace tmpst{
      * returns a one dimentional stream of samples of display
      */
     Mat frameStream::averageFrames(std::vector<int> & indices){
+        if(average_mode != AVERAGE_MEAN || reject_threshold > 0)
+            return averageFramesRobust(indices);
+
         Mat sum_frames = Mat::zeros(1, pixels_per_image, CV_32F); //larger size to handle summantion
 
         auto begin = indices.begin(), end = indices.end();
         while(begin!=end){
             Mat frame = makeMatrix(*begin++, all_samples);
-            frame.convertTo(frame,CV_32F);
-            sum_frames += frame/frame_average;
+            kernels::accumulate(frame.ptr<unsigned short>(0), sum_frames.ptr<float>(0), pixels_per_image, 1.0f/frame_average);
+        }
+        sum_frames = sum_frames/frame_average;
+
+        return sum_frames;
+    }
+
+    /**
+     * How well every frame matches the median of all the frames (correlation coefficient, 1 is a perfect match).
+     */
+    vector<double> frameStream::scoreFrames(const vector<const unsigned short *> & frames){
+        Mat consensus(1, pixels_per_image, CV_32F);
+        float * median = consensus.ptr<float>(0);
+        long block = 1<<14;
+
+#pragma omp parallel for schedule(dynamic)
+        for(long start=0; start<pixels_per_image; start+=block){
+            vector<const unsigned short *> part(frames.size());
+            for(int k=0; k<frames.size(); k++) part[k] = frames[k]+start;
+            kernels::trimmedMean(part.data(), part.size(), (part.size()-1)/2, median+start, min<long>(block, pixels_per_image-start));
+        }
+
+        double median_sum = 0, median_squared = 0;
+        for(long i=0; i<pixels_per_image; i++){
+            median_sum += median[i];
+            median_squared += double(median[i])*median[i];
+        }
+
+        vector<double> scores(frames.size(), 0);
+#pragma omp parallel for
+        for(int k=0; k<frames.size(); k++){
+            double frame_sum = 0, frame_squared = 0, both = 0;
+            for(long i=0; i<pixels_per_image; i++){
+                double value = frames[k][i];
+                frame_sum += value;
+                frame_squared += value*value;
+                both += value*median[i];
+            }
+
+            double n = pixels_per_image;
+            double spread = sqrt((n*frame_squared - frame_sum*frame_sum)*(n*median_squared - median_sum*median_sum));
+            scores[k] = (spread > 0) ? (n*both - frame_sum*median_sum)/spread : 0;
+        }
+        return scores;
+    }
+
+    /**
+     * averageFrames that holds up to bad frames.
+     * Whole frames that match the rest badly (interference, misaligned) are dropped first,
+     * then every sample is a trimmed mean or median across the frames left.
+     */
+    Mat frameStream::averageFramesRobust(vector<int> & indices){
+        vector<const unsigned short *> frames;
+        for(int i=0; i<indices.size(); i++){
+            Mat frame = makeMatrix(indices[i], all_samples);
+            if(!frame.empty()) frames.push_back(frame.ptr<unsigned short>(0));
+        }
+        if(frames.empty()) return Mat::zeros(1, pixels_per_image, CV_32F);
+
+        if(reject_threshold > 0 && frames.size() >= 3){
+            TRACE_SCOPE("frame rejection", frequency);
+            vector<double> scores = scoreFrames(frames);
+
+            // median and median absolute deviation of the scores, so the bad frames do not move the bar
+            vector<double> sorted = scores;
+            nth_element(sorted.begin(), sorted.begin()+sorted.size()/2, sorted.end());
+            double middle = sorted[sorted.size()/2];
+            for(double & score : sorted) score = fabs(score-middle);
+            nth_element(sorted.begin(), sorted.begin()+sorted.size()/2, sorted.end());
+            double deviation = max(1.4826*sorted[sorted.size()/2], 1e-4);
+
+            vector<const unsigned short *> kept;
+            for(int k=0; k<frames.size(); k++){
+                if(scores[k] < middle - reject_threshold*deviation){
+                    cout << "Band " << frequency << " rejected frame " << k << " (score " << scores[k]
+                         << ", median " << middle << ")" << endl;
+                }else{
+                    kept.push_back(frames[k]);
+                    if(verbose) cout << "Frame " << k << " score " << scores[k] << endl;
+                }
+            }
+            frames = kept;
+        }
+
+        Mat average(1, pixels_per_image, CV_32F);
+        float * out = average.ptr<float>(0);
+        long block = 1<<14;
+
+        // a mean of the kept frames needs no sorting
+        if(average_mode == AVERAGE_MEAN){
+            average.setTo(0);
+            float scale = 1.0f/frames.size();
+#pragma omp parallel for schedule(dynamic)
+            for(long start=0; start<pixels_per_image; start+=block){
+                for(const unsigned short * frame : frames)
+                    kernels::accumulate(frame+start, out+start, min<long>(block, pixels_per_image-start), scale);
+            }
+            return average;
+        }
+
+        size_t trim = (frames.size()-1)/2; // median
+        if(average_mode == AVERAGE_TRIMMED) trim = min(size_t(frames.size()*trim_fraction), trim);
+
+#pragma omp parallel for schedule(dynamic)
+        for(long start=0; start<pixels_per_image; start+=block){
+            vector<const unsigned short *> part(frames.size());
+            for(int k=0; k<frames.size(); k++) part[k] = frames[k]+start;
+            kernels::trimmedMean(part.data(), part.size(), trim, out+start, min<long>(block, pixels_per_image-start));
+        }
+
+        return average;
+    }
+
+    /**
+     * Measures the length of one frame to a fraction of a sample.
+     * Frame 0 is correlated against frames 1, 2, 4, 8... around where the current estimate says they start.
+     * Each peak is refined with a parabola, so every step gives a better estimate for the next (further) frame.
+     * Finally every frame is located and a least squares line through the starts gives the period.
+     */
+    double frameStream::estimatePeriod(int shift_amount){
+        double period = pixels_per_image + shift_amount;
+        if(frame_average < 2) return period;
+
+        int inverstion_mult = (inverted) ? -1 : 1; 
+        int window = 3; // samples searched either side of the estimate
+        Mat reference = makeMatrix(0, all_samples);
+
+        // finds where frame k starts, returns false if the search does not fit in all_samples
+        auto locate = [&](int k, double & start)->bool{
+            long predicted = lround(k*period);
+            if(predicted-window-1 < 0 || predicted+window+1+pixels_per_image >= all_samples.cols)
+                return false;
+
+            // one extra on either side so the parabola always has neighbours
+            vector<double> corr(2*window+3);
+            for(int j=-window-1; j<=window+1; j++)
+                corr[j+window+1] = inverstion_mult*correlation(makeMatrix(predicted+j, all_samples), reference);
+
+            int best = 1;
+            for(int j=2; j<=2*window+1; j++)
+                if(corr[j] > corr[best]) best = j;
+
+            start = predicted + (best-window-1) + parabolicPeak(corr[best-1], corr[best], corr[best+1]);
+            return true;
+        };
+
+        // coarse to fine
+        for(int k=1; k<frame_average; k*=2){
+            double start;
+            if(!locate(k, start)) break;
+            period = start/k;
+        }
+
+        // every frame, then fit a line through the origin (frame 0 starts at 0)
+        vector<double> starts(frame_average, -1);
+#pragma omp parallel for
+        for(int k=1; k<frame_average; k++){
+            double start;
+            if(locate(k, start)) starts[k] = start;
+        }
+
+        double numerator = 0, denominator = 0;
+        for(int k=1; k<frame_average; k++){
+            if(starts[k] < 0) continue;
+            numerator += k*starts[k];
+            denominator += double(k)*k;
+        }
+        if(denominator > 0) period = numerator/denominator;
+
+        return period;
+    }
+
+    /**
+     * Averages the frames, each one read from k*period with a fractional delay filter.
+     * Unlike averageFrames no rounding error builds up from frame to frame.
+     *
+     * returns a one dimentional stream of samples of display (floor(period) long)
+     */
+    Mat frameStream::averageFramesFractional(double period){
+        TRACE_SCOPE("average", frequency);
+        int frame_length = floor(period);
+        Mat sum_frames = Mat::zeros(1, frame_length, CV_32F);
+
+        const unsigned short * samples = all_samples.ptr<unsigned short>(0);
+        float * sum = sum_frames.ptr<float>(0);
+
+        // split the frame into pieces so the threads never write to the same samples
+        const int block_size = 1<<14;
+        int block_count = (frame_length+block_size-1)/block_size;
+
+#pragma omp parallel for
+        for(int block=0; block<block_count; block++){
+            int start = block*block_size;
+            int count = min(block_size, frame_length-start);
+
+            for(int k=0; k<frame_average; k++)
+                farrowAccumulate(samples, all_samples.cols, k*period+start, 1.0, sum+start, count, 1.0f/frame_average);
         }
         sum_frames = sum_frames/frame_average;
 
@@ -380,9 +834,11 @@ namespace tmpst{
 
     /**
      * Saves final_image, used for public access.
+     * The image is handed to the image writer, so it may still be encoding when this returns.
      */
     bool frameStream::saveImage(string filename){
-        imwrite(output_directory+filename+".jpg", final_image);
+        TRACE_SCOPE("write", frequency);
+        imageWriter::shared().write(output_directory+filename, final_image);
         return true;
     }
 
@@ -394,6 +850,7 @@ namespace tmpst{
      * returns factor to multiply with when converting cordinates from mini_image to final_image
      */
     float frameStream::writeMiniFrame(Mat & samples){
+        TRACE_SCOPE("mini frame", frequency);
         //reduce the amount of pixels for miniframe
         pair<int, int> reduced(width, height);
 
@@ -422,16 +879,8 @@ namespace tmpst{
 
         if(verbose) cout << endl << "Smaller resolution is: " << reduced.first << "x" << reduced.second << endl;
 
-        // stretch image to fit into final matrix resolution
-        Mat stretch = Mat(1,reduced.first*reduced.second, CV_16U);
-        resize(samples, stretch, Size(reduced.first*reduced.second,1));
-
-        final_mini_image = Mat::zeros(reduced.second, reduced.first, CV_8U);
-
-        final_mini_image = stretch.reshape(0,reduced.second);
-
-        // normalize frame to usigned char
-        normalize(final_mini_image, final_mini_image, 0, 255, NORM_MINMAX, CV_8UC1);
+        // stretch, normalize and deinterlace into the smaller image
+        rasterize(samples, final_mini_image, reduced.first, reduced.second, interlaced);
 
         //return the size ratio
         return float(width)/float(reduced.first);
@@ -5,19 +5,30 @@
 #include <opencv2/imgcodecs.hpp>
 #include <vector>
 #include <unordered_map>
+#include "correlator.h"
+#include "ringBuffer.h"
+#include "frameAccumulator.h"
+#include "sampleSource.h"
 #ifndef _TEMPEST_H_
 #include "extraMath.h"
 #endif
 
 
 namespace tmpst{
+
+    // how the aligned frames are averaged into one (per sample across the frames)
+    enum averageMode{AVERAGE_MEAN, AVERAGE_TRIMMED, AVERAGE_MEDIAN};
+
     class frameStream{
+        friend class benchmark;     // times the private stages one by one
+
 
     private:
         // =============================== DATA SOURCES ========================================
         cv::Mat all_samples;
         cv::Mat final_image;
         cv::Mat final_mini_image;
+        cv::Mat average_frame;      // the averaged frame final_image is drawn from
 
         std::vector<int> indices;
 
@@ -32,6 +43,14 @@ namespace tmpst{
         bool inverted;
         bool interlaced;
         std::string output_directory;
+        correlationMode correlation_mode = CORRELATION_FFT;
+        bool fractional = false;    // align frames to a fraction of a sample
+        bool streaming = false;     // fold frames into accumulator instead of keeping all_samples
+        frameAccumulator accumulator;
+        std::string spill_file;     // where all_samples was written out to free memory (empty when held)
+        averageMode average_mode = AVERAGE_MEAN;
+        double trim_fraction = 0.2; // part of the frames dropped from either end with AVERAGE_TRIMMED
+        double reject_threshold = 0;// frames scoring this many deviations under the rest are dropped (0 keeps all)
 
         // ================================= CALCULATED =======================================
 
@@ -40,14 +59,23 @@ namespace tmpst{
         int total_sample_count;
 
         long pixels_per_image;       // the number of pixels the sampling rate allows for
+        double frame_period;         // measured samples per frame (only with fractional)
+        int used_shift = 0;          // shift the frames were averaged with
         
         // ========================= SAMPLE PROCESSORS Internal ===============================
 
+        void allocateSamples();
         cv::Mat makeMatrix(int start_index, cv::Mat & samples);
         int shiftIndex(int index, int amount); //just normal summantion, but with error checking
         std::unordered_map<int, unsigned int> corrolateFrames(int shift_max);
         cv::Mat averageFrames(std::vector<int> & indices);
+        cv::Mat averageFramesRobust(std::vector<int> & indices);
+        std::vector<double> scoreFrames(const std::vector<const unsigned short *> & frames);
 
+        double estimatePeriod(int shift_amount);
+        cv::Mat averageFramesFractional(double period);
+
+        void drawFinalFrame();
         std::pair<int,int> centerImage(cv::Mat & image);
         float writeMiniFrame(cv::Mat & samples);
 
@@ -67,19 +95,39 @@ namespace tmpst{
         
         double getFrequency();
 
+        void setCorrelationMode(correlationMode mode);
+        void setFractional(bool fractional);
+        void setAveraging(averageMode mode, double trim, double reject);
+        void setStreaming(int calibration_frames, int shift_max);
+
         cv::Mat getFinalImage();
+        const cv::Mat & getSamples();
+        cv::Mat getMiniImage();
+
+        size_t sampleBytes();
+        void useSampleBuffer(cv::Mat & buffer);
+        bool spillSamples();
+        bool restoreSamples();
         // =============================== LOADING DATA ======================================
 
         bool loadDataRx(uhd::usrp::multi_usrp::sptr usrp, double offset, size_t channel, int frame_ignore);
 
+        bool loadDataSource(sampleSource & source, int frame_ignore);
+
         bool loadDataFile(std::string filename, int frame_ignore);
 
+        bool loadDataRing(const ringBuffer<unsigned short> & ring, uint64_t & end);
+
         // ============================== SAMPLE PROCESSORS ==================================
 
         std::pair<int, unsigned int> processSamples(int shift_max);
 
         void createFinalFrame(int shiftAmount);
 
+        void loadAverage(const cv::Mat & frame, int shift_amount);
+        cv::Mat getAverageFrame();
+        int getShift();
+
         // ==================================== EXTRA  =======================================
 
         cv::Mat reconInterlace(cv::Mat interlaced);
@@ -0,0 +1,75 @@
+// Program options
+#include <boost/program_options.hpp>
+#include <boost/format.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <iostream>
+// internal
+#include "signalGenerator.h"
+
+namespace ops = boost::program_options;
+using namespace std;
+
+/**
+ * Writes a synthetic capture of a known image, for testing and benchmarking without a receiver.
+ * The file can be read back with tempAtk --input.
+ */
+int main(int argc, char * argv[]){
+    string res_string, image_file, output_file;
+    double refresh, rate, frames, refresh_error, drift, noise;
+    unsigned int seed;
+
+    ops::options_description desc("Available Options");
+    desc.add_options()
+        ("help",                                                                                    "help message")
+        ("res",         ops::value<string>(&res_string)->       default_value("1024x768"),          "resolution of the simulated monitor")
+        ("refresh",     ops::value<double>(&refresh)->          default_value(75.024),              "refresh rate of the simulated monitor")
+        ("rate",        ops::value<double>(&rate)->             default_value(25e6),                "sample rate of the capture")
+        ("frames",      ops::value<double>(&frames)->           default_value(5),                   "amount of frames to write")
+        ("error",       ops::value<double>(&refresh_error)->    default_value(0.0),                 "ppm the real refresh rate is off from --refresh")
+        ("drift",       ops::value<double>(&drift)->            default_value(0.0),                 "ppm per second the refresh error changes")
+        ("noise",       ops::value<double>(&noise)->            default_value(50.0),                "standard deviation of the added noise")
+        ("seed",        ops::value<unsigned int>(&seed)->       default_value(1234),                "noise seed")
+        ("image",       ops::value<string>(&image_file),                                            "image on the monitor (a test pattern if not given)")
+        ("out",         ops::value<string>(&output_file)->      default_value("generated.dat"),     "file the sc16 samples are written to")
+        ("interlaced",                                                                              "simulate an interlaced scan display")
+    ;
+
+    ops::variables_map var_map;
+    ops::store(ops::parse_command_line(argc, argv, desc), var_map);
+    ops::notify(var_map);
+
+    if (var_map.count("help")) {
+        std::cout << boost::format("Synthetic Tempest capture generator %s") % desc << std::endl;
+        return ~0;
+    }
+
+    // same as tempAtk, the timing of an interlaced display is looked up at the frame rate
+    bool interlaced = var_map.count("interlaced") > 0;
+    if(interlaced) refresh /= 2;
+
+    tmpst::signalGenerator generator(res_string, refresh, rate);
+    if(!generator.valid()){
+        cerr << "Resolution " << res_string << " at " << refresh << "Hz does not exist" << endl;
+        return -1;
+    }
+
+    generator.setRefreshError(refresh_error, drift);
+    generator.setNoise(noise);
+    generator.setInterlaced(interlaced);
+    generator.setSeed(seed);
+
+    if(var_map.count("image")){
+        cv::Mat screen = cv::imread(image_file, cv::IMREAD_GRAYSCALE);
+        if(screen.empty()){
+            cerr << "Could not read image: " << image_file << endl;
+            return -1;
+        }
+        generator.setImage(screen);
+    }
+
+    if(!generator.writeFile(output_file, frames)) return -1;
+
+    cout << "Wrote " << frames << " frames of " << res_string << " (" << generator.getWidth() << "x" << generator.getHeight()
+         << " total) to " << output_file << endl;
+    return 0;
+}
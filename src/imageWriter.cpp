@@ -0,0 +1,104 @@
+#include "imageWriter.h"
+#include <opencv2/imgcodecs.hpp>
+#include <iostream>
+
+using namespace cv;
+using namespace std;
+
+namespace tmpst{
+
+    imageWriter::imageWriter(): queue(16) {};
+    imageWriter::~imageWriter(){ finish(); }
+
+    imageWriter & imageWriter::shared(){
+        static imageWriter writer;
+        return writer;
+    }
+
+    void imageWriter::start(int threads, imageFormat format, int quality){
+        this->format = format;
+        this->quality = quality;
+
+        for(int t=0; t<threads; t++){
+            writers.push_back(thread([this](){
+                pendingImage pending;
+                while(queue.pop(pending)){
+                    encode(pending.filename, pending.image);
+
+                    lock_guard<mutex> guard(idle_lock);
+                    if(--unwritten == 0) idle.notify_all();
+                }
+            }));
+        }
+    }
+
+    string imageWriter::extension(){
+        switch(format){
+            case IMAGE_PNG: return ".png";
+            case IMAGE_PGM: return ".pgm";
+            default:        return ".jpg";
+        }
+    }
+
+    void imageWriter::encode(const string & filename, const Mat & image){
+        vector<int> parameters;
+        if(format == IMAGE_JPEG && quality >= 0) parameters = {IMWRITE_JPEG_QUALITY, quality};
+        if(format == IMAGE_PNG && quality >= 0) parameters = {IMWRITE_PNG_COMPRESSION, quality};
+        if(format == IMAGE_PGM) parameters = {IMWRITE_PXM_BINARY, 1};
+
+        try{
+            if(!imwrite(filename+extension(), image, parameters))
+                cerr << "Could not write image: " << filename+extension() << endl;
+        }catch(cv::Exception & e){
+            cerr << "Could not write image: " << filename+extension() << " (" << e.what() << ")" << endl;
+        }
+    }
+
+    /**
+     * Queues a copy of the image (the caller can keep changing its own)
+     */
+    void imageWriter::write(string filename, const Mat & image){
+        if(!writers.empty()){
+            pendingImage pending;
+            pending.filename = filename;
+            pending.image = image.clone();
+
+            {
+                lock_guard<mutex> guard(idle_lock);
+                unwritten++;
+            }
+            if(queue.push(move(pending))) return;
+
+            lock_guard<mutex> guard(idle_lock);
+            if(--unwritten == 0) idle.notify_all();
+        }
+
+        encode(filename, image);
+    }
+
+    /**
+     * For callers that hand the images on (the daemon replies with them), the writers keep running
+     */
+    void imageWriter::flush(){
+        unique_lock<mutex> guard(idle_lock);
+        idle.wait(guard, [this]{ return unwritten == 0; });
+    }
+
+    void imageWriter::finish(){
+        queue.close();
+        for(thread & writer : writers) writer.join();
+        writers.clear();
+    }
+
+    bool imageWriter::parseFormat(string name, imageFormat & format){
+        if(name == "jpg" || name == "jpeg") format = IMAGE_JPEG;
+        else if(name == "png") format = IMAGE_PNG;
+        else if(name == "pgm") format = IMAGE_PGM;
+        else{
+            cerr << "Unknown image format " << name << ", use jpg, png or pgm" << endl;
+            return false;
+        }
+        return true;
+    }
+
+}
@@ -0,0 +1,56 @@
+#ifndef _IMAGEWRITER_H_
+#define _IMAGEWRITER_H_
+#include <opencv2/core/utility.hpp>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "boundedQueue.h"
+
+namespace tmpst{
+
+    enum imageFormat{IMAGE_JPEG, IMAGE_PNG, IMAGE_PGM};
+
+    /**
+     * Encodes and writes images on background threads so processing never waits on the disk.
+     * Every image is copied into the queue, a full queue makes write wait (instead of using more memory).
+     * Without writer threads (or after finish) images are written straight away.
+     */
+    class imageWriter{
+    private:
+        struct pendingImage{
+            std::string filename;
+            cv::Mat image;
+        };
+
+        boundedQueue<pendingImage> queue;
+        std::vector<std::thread> writers;
+
+        std::mutex idle_lock;
+        std::condition_variable idle;
+        size_t unwritten = 0;           // queued or being encoded
+
+        imageFormat format = IMAGE_JPEG;
+        int quality = -1;               // jpeg quality or png compression, -1 is the opencv default
+
+        void encode(const std::string & filename, const cv::Mat & image);
+
+        imageWriter();
+
+    public:
+        ~imageWriter();
+
+        static imageWriter & shared();
+
+        void start(int threads, imageFormat format, int quality);
+        void write(std::string filename, const cv::Mat & image);   // filename without the extension
+        void flush();                                               // waits until every queued image is on disk
+        void finish();                                              // writes what is queued, then stops the threads
+
+        static bool parseFormat(std::string name, imageFormat & format);
+        std::string extension();
+    };
+
+}
+#endif
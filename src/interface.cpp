@@ -18,9 +18,16 @@
 // internal
 #include "tempest.h"
 #include "resconvert.h"
+#include "kernels.h"
+#include "trace.h"
+#include "imageWriter.h"
+#include "batch.h"
+#include "daemon.h"
 // misc
 #include <thread>
 #include <string>
+#include <omp.h>
+#include <csignal>
 
 namespace ops = boost::program_options;
 using namespace std;
@@ -29,7 +36,8 @@ using namespace std;
 bool verbose = false;
 
 /**
- * checks if the sensor has been locked. Code taken from Ettus example script
+ * checks if the sensor has been locked. Based on the Ettus example script, but returns as
+ * soon as the sensor reads locked instead of after setup_time, which is only the timeout.
  */
 typedef std::function<uhd::sensor_value_t(const std::string&)> get_sensor_fn_t;
 bool check_locked_sensor(   std::vector<std::string> sensor_names,
@@ -41,36 +49,106 @@ bool check_locked_sensor(   std::vector<std::string> sensor_names,
         == sensor_names.end())
         return false;
 
-    auto setup_timeout = std::chrono::steady_clock::now()
-                         + std::chrono::milliseconds(int64_t(setup_time * 1000));
-    bool lock_detected = false;
+    auto setup_start = std::chrono::steady_clock::now();
+    auto setup_timeout = setup_start + std::chrono::milliseconds(int64_t(setup_time * 1000));
 
     if(verbose) std::cout << boost::format("Waiting for \"%s\": ") % sensor_name;
     if(verbose) std::cout.flush();
 
-    while (true) {
-        if (lock_detected and (std::chrono::steady_clock::now() > setup_timeout)) {
-            if(verbose) std::cout << " locked." << std::endl;
-            break;
+    while (!get_sensor_fn(sensor_name).to_bool()) {
+        if (std::chrono::steady_clock::now() > setup_timeout) {
+            if(verbose) std::cout << std::endl;
+            throw std::runtime_error(
+                str(boost::format(
+                        "timed out waiting for a lock on sensor \"%s\"")
+                    % sensor_name));
         }
-        if (get_sensor_fn(sensor_name).to_bool()) {
-            if(verbose) std::cout << "+";
-            if(verbose) std::cout.flush();
-            lock_detected = true;
-        } else {
-            if (std::chrono::steady_clock::now() > setup_timeout) {
-                if(verbose) std::cout << std::endl;
-                throw std::runtime_error(
-                    str(boost::format(
-                            "timed out waiting for consecutive locks on sensor \"%s\"")
-                        % sensor_name));
-            }
-            if(verbose) std::cout << "_";
-            if(verbose) std::cout.flush();
+        if(verbose) std::cout << "_";
+        if(verbose) std::cout.flush();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if(verbose) std::cout << boost::format(" locked after %.3fs.")
+                             % std::chrono::duration<double>(std::chrono::steady_clock::now() - setup_start).count() << std::endl;
+    return true;
+}
+
+/**
+ * Frontend settings of the receiver, NAN (or an empty antenna) is not set yet.
+ * A bandwidth of 0 leaves the frontend filter alone.
+ */
+struct frontendSettings{
+    double rate = NAN, gain = NAN, bw = NAN;
+    std::string ant;
+};
+
+/**
+ * Sets what differs between wanted and applied on every channel, then remembers it in applied.
+ * The daemon keeps applied between jobs so a job only pays for the settings it changes.
+ * False when nothing had to change.
+ */
+bool applyFrontend(uhd::usrp::multi_usrp::sptr usrp, const std::vector<size_t> & channels,
+                   const frontendSettings & wanted, frontendSettings & applied){
+    bool changed = wanted.rate != applied.rate || wanted.gain != applied.gain
+                   || (wanted.bw > 0 && wanted.bw != applied.bw) || wanted.ant != applied.ant;
+
+    // set sample rate
+    if(wanted.rate != applied.rate){
+        if(verbose) std::cout << boost::format("Setting RX Rate: %f Msps...") % (wanted.rate / 1e6) << std::endl;
+        usrp->set_rx_rate(wanted.rate);
+        if(verbose) std::cout << boost::format("Actual RX Rate: %f Msps...") % (usrp->get_rx_rate() / 1e6) << std::endl << std::endl;
+    }
+
+    // every channel gets the same frontend settings
+    for(size_t chan : channels){
+        // set the rf gain
+        if(wanted.gain != applied.gain){
+            if(verbose) std::cout << boost::format("Setting RX Gain: %f dB...") % wanted.gain << std::endl;
+            usrp->set_rx_gain(wanted.gain, chan);
+            if(verbose) std::cout << boost::format("Actual RX Gain: %f dB...") % usrp->get_rx_gain(chan) << std::endl << std::endl;
+        }
+
+        // set the IF filter bandwidth
+        if(wanted.bw > 0 && wanted.bw != applied.bw){
+            if(verbose) std::cout << boost::format("Setting RX Bandwidth: %f MHz...") % (wanted.bw / 1e6) << std::endl;
+            usrp->set_rx_bandwidth(wanted.bw, chan);
+            if(verbose) std::cout << boost::format("Actual RX Bandwidth: %f MHz...") % (usrp->get_rx_bandwidth(chan) / 1e6) << std::endl << std::endl;
+        }
+
+        // set the antenna
+        if(wanted.ant != applied.ant){
+            if(verbose) std::cout << boost::format("Setting RX Antenna: %s") % wanted.ant << std::endl;
+            usrp->set_rx_antenna(wanted.ant, chan);
+            if(verbose) std::cout << boost::format("Actual RX Antenna: %s") % usrp->get_rx_antenna(chan) << std::endl << std::endl;
+        }
+    }
+
+    double filter = applied.bw; // untouched without a bandwidth
+    applied = wanted;
+    if(wanted.bw <= 0) applied.bw = filter;
+    return changed;
+}
+
+/**
+ * Turns --res (and the refresh rate) into the width and height of the display.
+ * With exact the resolution is taken as written instead of looked up.
+ */
+bool parseResolution(string res_string, double refresh, bool exact, int & width, int & height){
+    if(!exact){
+        height = tmpst::getHeight(res_string,refresh);
+        width = tmpst::getWidth(res_string,refresh);
+        if(height == 0 || width == 0){
+            cerr << "Resolution " << res_string << " does not exist. If you are sure this is the resolution enable --x (exact resolution)" << endl;
+            return false;
+        }
+    }else {
+        try{
+            width = stoi(res_string.substr(0,res_string.find('x')));
+            height = stoi(res_string.substr(res_string.find('x')+1));
+        }catch(exception& e){
+            cerr << "The width and height need to be written as --res=1234x321" << endl;
+            return false;
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
-    if(verbose) std::cout << std::endl;
     return true;
 }
 
@@ -84,10 +162,10 @@ int UHD_SAFE_MAIN(int argc, char * argv[]){
     uhd::set_thread_priority_safe();
 
     // Inputs
-    string addr, folder, ant, subdev, ref, res_string, input_file, config_file;
+    string addr, folder, ant, subdev, ref, res_string, input_file, config_file, corr_mode, mem_budget, trace_file, image_format, cache_file, registration, average_mode, channel_list, sim_replay, batch_input, batch_summary, daemon_socket;
     size_t channel;
-    double rate, freq, gain, bw, lo_offset, refresh, setup_time, overlap;
-    int multi, average_amount, width, height, frame_ignore, shift_max;
+    double rate, freq, gain, bw, lo_offset, refresh, setup_time, overlap, live_rate, settle, sim_latency, detect_seconds, trim, reject, sim_overflow, sim_timeout, sim_buffer, wideband;
+    int multi, average_amount, width, height, frame_ignore, shift_max, threads, live_count, stream_calibration, writers, image_quality, detect_top, batch_workers, batch_threads;
     bool exact_resolution = false;
     bool interlaced = false;
     bool inverted = false;
@@ -109,16 +187,52 @@ int UHD_SAFE_MAIN(int argc, char * argv[]){
         ("ant",         ops::value<std::string>(&ant)->         default_value("TX/RX"),             "antenna selection")
         ("subdev",      ops::value<std::string>(&subdev),                                           "subdevice specification")
         ("channel",     ops::value<size_t>(&channel)->          default_value(0),                   "which channel to use")
+        ("wideband",    ops::value<double>(&wideband)->         default_value(0.0),                 "capture every band at once at this sample rate and split it into the bands in software instead of retuning (0 retunes)")
+        ("channels",    ops::value<std::string>(&channel_list),                                     "capture on several channels at once, eg 0,1 (channels across motherboards need a shared pps), implies --schedule. With --sim the amount of simulated channels, eg 4")
         ("bw",          ops::value<double>(&bw),                                                    "analog frontend filter bandwidth in Hz")
         ("ref",         ops::value<std::string>(&ref)->         default_value("internal"),          "reference source (internal, external, mimo)")
-        ("setup",       ops::value<double>(&setup_time)->       default_value(1.0),                 "seconds of setup time")
+        ("setup",       ops::value<double>(&setup_time)->       default_value(1.0),                 "most seconds to wait for the LO and reference to lock")
         ("multi",       ops::value<int>(&multi)->               default_value(1),                   "multiple of the amount of bandwidths you want to combine (0 for auto calculation)")
         ("overlap",     ops::value<double>(&overlap)->          default_value(0.5),                 "overlap between the sub-bands as a percentage (0.9 mean 90% of band A and B are the same)")
         ("input",       ops::value<std::string>(&input_file),                                       "filename of raw short IQ samples, used instead of receiver")
+        ("daemon",      ops::value<std::string>(&daemon_socket),                                    "set the receiver up once and take jobs from this unix socket, one line of key=value settings (freq, lo-offset, rate, gain, bw, ant, res, refresh, average, multi, overlap, folder) per connection, eg with nc -U")
+        ("batch",       ops::value<std::string>(&batch_input),                                      "process every capture in a directory (or listed in a manifest: file [res|-] [refresh] per line) like --input, each into its own folder")
+        ("batch_workers",ops::value<int>(&batch_workers)->      default_value(2),                   "captures processed at the same time with --batch")
+        ("batch_threads",ops::value<int>(&batch_threads)->      default_value(0),                   "processing threads of every batch worker (0 shares the threads out)")
+        ("batch_summary",ops::value<std::string>(&batch_summary),                                   "json summary of the batch (defaults to batch.json in the folder)")
+        ("from_cache",  ops::value<std::string>(&cache_file),                                       "redraw and combine the bands of an earlier run from its bands.cache (no capture or correlation)")
         ("ignore",      ops::value<int>(&frame_ignore)->        default_value(0),                   "specify how many frames to ignore from the received data (can help in certain cases)")
         ("max_shift",   ops::value<int>(&shift_max)->           default_value(200),                 "maximum amount each frame can shift to align each other (higher amount make it slower)")
+        ("corr_mode",   ops::value<std::string>(&corr_mode)->   default_value("fft"),               "how frames are aligned: fft (all shifts at once) or brute (one correlation per shift, reference)")
+        ("average_mode",ops::value<std::string>(&average_mode)->default_value("mean"),              "how the aligned frames are averaged: mean, trimmed or median (per sample across the frames)")
+        ("trim",        ops::value<double>(&trim)->             default_value(0.2),                 "part of the frames dropped from either end of every sample with --average_mode=trimmed")
+        ("reject",      ops::value<double>(&reject)->           default_value(0),                   "drop frames that match the median frame this many deviations worse than the rest (0 keeps every frame)")
+        ("register",    ops::value<std::string>(&registration)->default_value("template"),          "how bands are lined up: template (full image template match) or phase (phase correlation of the small images, in parallel)")
+        ("threads",     ops::value<int>(&threads)->             default_value(0),                   "amount of threads used for processing (0 uses every core)")
+        ("stream",      ops::value<int>(&stream_calibration)->  default_value(0),                   "fold frames into a running average as they arrive, finding the shift from this many frames (0 keeps every frame in memory)")
+        ("mem_budget",  ops::value<std::string>(&mem_budget)->  default_value("0"),                 "most memory the band samples may use together, eg 8G (0 is no limit), processed bands are spilled to the output folder")
+        ("schedule",                                                                                "sweep the bands with timed retunes on one streamer, each band starting at the same frame phase")
+        ("settle",      ops::value<double>(&settle)->           default_value(0.0),                 "seconds the LO needs after a scheduled retune (0 measures it)")
+        ("sim",                                                                                     "use a simulated receiver instead of a usrp (scheduled sweep)")
+        ("sim_latency", ops::value<double>(&sim_latency)->      default_value(0.002),               "retune latency of the simulated receiver in seconds")
+        ("sim_realtime",                                                                            "run the simulated receiver at the real sample rate instead of as fast as possible")
+        ("sim_replay",  ops::value<std::string>(&sim_replay),                                       "recording (--file format) the simulated receiver plays instead of its test pattern")
+        ("sim_overflow",ops::value<double>(&sim_overflow)->     default_value(0.0),                 "chance of an injected overflow on every simulated recv")
+        ("sim_timeout", ops::value<double>(&sim_timeout)->      default_value(0.0),                 "chance of an injected timeout on every simulated recv")
+        ("sim_buffer",  ops::value<double>(&sim_buffer)->       default_value(0.0),                 "seconds of samples the simulated device holds, a real time host further behind overflows (0 never does)")
+        ("detect",                                                                                  "work out the resolution and refresh rate from a capture of the base band (or --input) and list the best matches")
+        ("detect_time", ops::value<double>(&detect_seconds)->   default_value(1.0),                 "seconds captured for --detect")
+        ("detect_top",  ops::value<int>(&detect_top)->          default_value(5),                   "amount of matches --detect lists")
+        ("live",                                                                                    "keep receiving and reconstruct the newest frames continuously (receiver only)")
+        ("live_rate",   ops::value<double>(&live_rate)->        default_value(1.0),                 "images per second in live mode")
+        ("live_count",  ops::value<int>(&live_count)->          default_value(0),                   "amount of images to make in live mode (0 runs until ctrl-c)")
         ("interlaced",                                                                              "select if the display you are reconstructing is an interlaced scan display")
         ("inverted",                                                                                "select if the display is inverted, resulting in the centering being incorrect")
+        ("fractional",                                                                              "measure the refresh rate from the capture to a fraction of a sample and resample the frames onto it")
+        ("image_format",ops::value<std::string>(&image_format)->default_value("jpg"),               "format of the saved images: jpg, png or pgm")
+        ("image_quality",ops::value<int>(&image_quality)->      default_value(-1),                  "jpg quality (0-100) or png compression (0-9), -1 keeps the default")
+        ("writers",     ops::value<int>(&writers)->             default_value(2),                   "threads encoding images in the background (0 writes them straight away)")
+        ("trace",       ops::value<std::string>(&trace_file),                                       "write a chrome trace (chrome://tracing or perfetto) of every processing stage to this file and print a summary")
         ("v",                                                                                       "print all information")
         ("x",                                                                                       "Use the unconverted resolution entered")
     ;
@@ -151,30 +265,138 @@ int UHD_SAFE_MAIN(int argc, char * argv[]){
     }
     inverted = var_map.count("inverted");
 
+    if(threads > 0) omp_set_num_threads(threads);
+    if(var_map.count("trace")) tmpst::trace::enable();
+
+    tmpst::imageFormat format;
+    if(!tmpst::imageWriter::parseFormat(image_format, format)) return -1;
+    tmpst::imageWriter::shared().start(writers, format, image_quality);
+    if(verbose) cout << "processing threads: " << omp_get_max_threads() << endl;
+
     // string resolution to int
-    if(!exact_resolution){
-        height = tmpst::getHeight(res_string,refresh);
-        width = tmpst::getWidth(res_string,refresh);
-        if(height == 0 || width == 0){
-            cerr << "Resolution " << res_string << " does not exist. If you are sure this is the resolution enable --x (exact resolution)" << endl;
-            return -1;
-        }
-    }else {
+    if(!parseResolution(res_string, refresh, exact_resolution, width, height)) return -1;
+    if(verbose) cout << "width: " << width << " height: " << height << endl;
+    if(verbose) cout << "sample kernels: " << tmpst::kernels::levelName(tmpst::kernels::currentLevel()) << endl;
+
+    // channels the bands are spread over (just --channel unless --channels is given)
+    vector<size_t> channels(1, channel);
+    if(var_map.count("channels") && var_map.count("sim") && input_file.empty()){
+        // the simulated receiver takes an amount of channels, numbered from 0
+        size_t count, used;
         try{
-            width = stoi(res_string.substr(0,res_string.find('x')));
-            height = stoi(res_string.substr(res_string.find('x')+1));
-        }catch(exception& e){
-            cerr << "The width and height need to be written as --res=1234x321" << endl;
+            count = stoul(channel_list, &used);
+            if(used != channel_list.size() || count == 0) throw invalid_argument(channel_list);
+        }catch(exception & e){
+            cerr << "With --sim the channels are an amount, eg --channels=4" << endl;
             return -1;
         }
+        channels.clear();
+        for(size_t c=0; c<count; c++) channels.push_back(c);
+        channel = channels[0];
+    }else if(var_map.count("channels")){
+        channels.clear();
+        stringstream list(channel_list);
+        string entry;
+        while(getline(list, entry, ',')){
+            try{
+                channels.push_back(stoul(entry));
+            }catch(exception & e){
+                cerr << "The channels need to be written as --channels=0,1" << endl;
+                return -1;
+            }
+        }
+        if(channels.empty()) channels.push_back(channel);
+        channel = channels[0];
     }
-    if(verbose) cout << "width: " << width << " height: " << height << endl;
+
+    // processing settings, the same for every tempest made
+    tmpst::averageMode averaging = tmpst::AVERAGE_MEAN;
+    if(average_mode == "trimmed") averaging = tmpst::AVERAGE_TRIMMED;
+    else if(average_mode == "median") averaging = tmpst::AVERAGE_MEDIAN;
+    else if(average_mode != "mean") cout << "Unknown average mode " << average_mode << ", using mean" << endl;
+    tmpst::registrationMode band_registration = tmpst::REGISTRATION_TEMPLATE;
+    if(registration == "phase") band_registration = tmpst::REGISTRATION_PHASE;
+    else if(registration != "template") cout << "Unknown registration " << registration << ", using template" << endl;
+    if(stream_calibration > 0 && var_map.count("fractional"))
+        cout << "--fractional needs every frame in memory, it is ignored with --stream" << endl;
+    if((averaging != tmpst::AVERAGE_MEAN || reject > 0) && (stream_calibration > 0 || var_map.count("fractional")))
+        cout << "--average_mode and --reject only apply to whole sample frames, they are ignored with --stream and --fractional" << endl;
+
+    auto configure = [&](tmpst::tempest * configured){
+        configured->setCorrelationMode(tmpst::correlator::parseMode(corr_mode));
+        configured->setAveraging(averaging, trim, reject);
+        configured->setFractional(var_map.count("fractional") > 0);
+        configured->setStreaming(stream_calibration);
+        configured->setMemoryBudget(tmpst::memoryBudget::parseSize(mem_budget));
+        configured->setWideband(wideband);
+        configured->setRegistration(band_registration);
+    };
+
+    // ============ batch of captures ===================
+    if(var_map.count("batch")){
+        // every job is a file tempest with the settings above, and the resolution and refresh of its line
+        tmpst::batchRunner batch([&](const tmpst::batchJob & job) -> tmpst::tempest *{
+            double job_refresh = refresh;
+            if(job.refresh > 0) job_refresh = (interlaced) ? job.refresh/2 : job.refresh;
+
+            int job_width, job_height;
+            string job_res = (job.resolution.empty()) ? res_string : job.resolution;
+            if(!parseResolution(job_res, job_refresh, exact_resolution, job_width, job_height)) return NULL;
+
+            tmpst::tempest * job_tempest = new tmpst::tempest(job.input_file, job.output_dir, job_width, job_height, job_refresh,
+                                                              average_amount, rate, frame_ignore, shift_max, inverted, interlaced, verbose);
+            configure(job_tempest);
+            return job_tempest;
+        }, folder);
+
+        if(!batch.load(batch_input)) return -1;
+        batch.run(batch_workers, batch_threads);
+        tmpst::imageWriter::shared().finish();
+
+        if(batch_summary.empty()) batch_summary = folder+((folder.empty() || folder.back() == '/') ? "" : "/")+"batch.json";
+        if(!batch.writeSummary(batch_summary)) cerr << "Could not write the batch summary to " << batch_summary << endl;
+
+        if(var_map.count("trace")){
+            tmpst::trace::summary(cout);
+            if(tmpst::trace::write(trace_file)) cout << "Trace written to " << trace_file << endl;
+        }
+
+        int failed = 0;
+        for(tmpst::batchJob & job : batch.getJobs()) failed += !job.done;
+        return (failed > 0) ? -1 : 0;
+    }
+
+    vector<shared_ptr<tmpst::simSource>> simulated;
+    uhd::usrp::multi_usrp::sptr usrp;                           // stays set up for daemon jobs
+    vector<shared_ptr<tmpst::sampleSource>> receiver_sources;   // scheduled sweep sources, empty sweeps on usrp
+    frontendSettings frontend, applied_frontend;
+    frontend.rate = (wideband > 0) ? wideband : rate; // the bands are cut out of a wider capture
+    frontend.gain = gain;
+    frontend.bw = (var_map.count("bw")) ? bw : 0;
+    frontend.ant = ant;
+
+    // ============ earlier run ===================
+    if(var_map.count("from_cache")){
+        main_tempest = new tmpst::tempest(cache_file, folder, width, height, refresh, average_amount, rate, frame_ignore, shift_max, inverted, interlaced, verbose);
+
+    // ============ simulated receiver ===================
+    }else if(input_file.empty() && var_map.count("sim")){
+        if(verbose) cout << "Using a simulated receiver with " << channels.size() << " channels" << endl;
+        simulated = tmpst::simSource::channels(channels.size(), (wideband > 0) ? wideband : rate, refresh, sim_latency, var_map.count("sim_realtime") > 0);
+        for(auto & simulated_channel : simulated){
+            if(var_map.count("sim_replay") && !simulated_channel->replay(sim_replay)) return -1;
+            simulated_channel->setFaults(sim_overflow, sim_timeout, sim_buffer);
+        }
+
+        receiver_sources.assign(simulated.begin(), simulated.end());
+        main_tempest = new tmpst::tempest(uhd::usrp::multi_usrp::sptr(), folder, width, height, refresh, multi, average_amount, overlap, freq, rate, lo_offset, channel ,frame_ignore, shift_max, inverted, interlaced, verbose); 
+        main_tempest->setSources(receiver_sources);
 
     // ============ no input file ===================
-    if(input_file.empty()){
+    }else if(input_file.empty()){
         //create a usrp device
         if(verbose) std::cout << boost::format("Creating the usrp device with: %s...") % addr << std::endl;
-        uhd::usrp::multi_usrp::sptr usrp = uhd::usrp::multi_usrp::make("--addr=\""+addr+"\""); // setting the IP address
+        usrp = uhd::usrp::multi_usrp::make("--addr=\""+addr+"\""); // setting the IP address
 
 
         // Lock mboard clocks
@@ -194,10 +416,8 @@ int UHD_SAFE_MAIN(int argc, char * argv[]){
             return ~0;
         }
 
-        // set sample rate
-        if(verbose) std::cout << boost::format("Setting RX Rate: %f Msps...") % (rate / 1e6) << std::endl;
-        usrp->set_rx_rate(rate);
-        if(verbose) std::cout << boost::format("Actual RX Rate: %f Msps...") % (usrp->get_rx_rate() / 1e6) << std::endl << std::endl;
+        // rate, gain, bandwidth and antenna
+        applyFrontend(usrp, channels, frontend, applied_frontend);
 
         // set freq
         if (var_map.count("freq")) { // with default of 0.0 this will always be true
@@ -206,31 +426,22 @@ int UHD_SAFE_MAIN(int argc, char * argv[]){
 
             uhd::tune_request_t tune_request(freq, lo_offset);
 
-            usrp->set_rx_freq(tune_request, channel);
-            if(verbose) std::cout << boost::format("Actual RX Freq: %f MHz...") % (usrp->get_rx_freq(channel) / 1e6) << std::endl;
+            for(size_t chan : channels){
+                usrp->set_rx_freq(tune_request, chan);
+                if(verbose) std::cout << boost::format("Actual RX Freq: %f MHz...") % (usrp->get_rx_freq(chan) / 1e6) << std::endl;
+            }
         }
 
-        // set the rf gain
-        if(verbose) std::cout << boost::format("Setting RX Gain: %f dB...") % gain << std::endl;
-        usrp->set_rx_gain(gain);
-        if(verbose) std::cout << boost::format("Actual RX Gain: %f dB...") % usrp->get_rx_gain() << std::endl << std::endl;
+        // the channels have to agree on device time for the bursts to line up
+        if(channels.size() > 1){
+            if(usrp->get_num_mboards() > 1 && ref == "internal")
+                cout << "Channels on several motherboards need --ref=external (or mimo) to share a time base" << endl;
 
-        // set the IF filter bandwidth
-        if(var_map.count("bw")){
-            if(verbose) std::cout << boost::format("Setting RX Bandwidth: %f MHz...") % (bw / 1e6) << std::endl;
-            usrp->set_rx_bandwidth(bw);
-            if(verbose) std::cout << boost::format("Actual RX Bandwidth: %f MHz...") % (usrp->get_rx_bandwidth() / 1e6) << std::endl << std::endl;
+            if(usrp->get_num_mboards() > 1 && ref != "internal") usrp->set_time_unknown_pps(uhd::time_spec_t(0.0));
+            else usrp->set_time_now(uhd::time_spec_t(0.0));
         }
 
-        // set the antenna
-        if(verbose) std::cout << boost::format("Setting RX Antenna: %s") % ant << std::endl;
-        usrp->set_rx_antenna(ant);
-        if(verbose) std::cout << boost::format("Actual RX Antenna: %s") % usrp->get_rx_antenna() << std::endl << std::endl;
-
-        // start setup
-        std::this_thread::sleep_for(std::chrono::milliseconds(int64_t(1000 * setup_time)));
-
-        // check Ref and LO Lock detect
+        // check Ref and LO Lock detect (polled, --setup is only the timeout)
         check_locked_sensor(usrp->get_rx_sensor_names(channel),
             "lo_locked",
             [usrp, channel](const std::string& sensor_name) {
@@ -257,6 +468,16 @@ int UHD_SAFE_MAIN(int argc, char * argv[]){
         // Transmit data to be processed
         main_tempest = new tmpst::tempest(usrp, folder, width, height, refresh, multi, average_amount, overlap, freq, rate, lo_offset, channel ,frame_ignore, shift_max, inverted, interlaced, verbose); 
 
+        // a wideband capture retunes once, and waits out the LO like a scheduled sweep does
+        if(var_map.count("schedule") || channels.size() > 1 || wideband > 0){
+            for(size_t chan : channels){
+                shared_ptr<tmpst::uhdSource> source = make_shared<tmpst::uhdSource>(usrp, chan, settle);
+                if(settle <= 0) source->measureSettling(freq, lo_offset);
+                receiver_sources.push_back(source);
+            }
+            main_tempest->setSources(receiver_sources);
+        }
+
                         
 
     }else{
@@ -265,9 +486,159 @@ int UHD_SAFE_MAIN(int argc, char * argv[]){
 
     }
 
-    main_tempest->initializeBands();
-    main_tempest->processBands();
+    configure(main_tempest);
+
+    // ============ daemon ===================
+    if(var_map.count("daemon")){
+        delete main_tempest; // every job makes its own, on the receiver set up above
+        if(!input_file.empty() || var_map.count("from_cache")){
+            cerr << "--daemon needs a receiver (or --sim), not --input or --from_cache" << endl;
+            return -1;
+        }
+
+        tmpst::daemonServer server(daemon_socket, [&](tmpst::daemonJob & job, string & reply) -> bool{
+            static const vector<string> known = {"freq", "lo-offset", "rate", "gain", "bw", "ant", "res", "refresh",
+                                                 "average", "multi", "overlap", "folder"};
+            for(auto & setting : job.settings){
+                if(find(known.begin(), known.end(), setting.first) == known.end()){
+                    reply = "unknown setting "+setting.first;
+                    return false;
+                }
+            }
+
+            // the command line settings, changed by the job
+            string job_folder = folder, job_res = res_string;
+            double job_freq = freq, job_lo_offset = lo_offset, job_rate = rate, job_refresh = 0, job_overlap = overlap;
+            int job_average = average_amount, job_multi = multi;
+            frontendSettings job_frontend = frontend;
+
+            if(!job.get("freq", job_freq) || !job.get("lo-offset", job_lo_offset) || !job.get("rate", job_rate)
+               || !job.get("gain", job_frontend.gain) || !job.get("bw", job_frontend.bw) || !job.get("refresh", job_refresh)
+               || !job.get("overlap", job_overlap) || !job.get("average", job_average) || !job.get("multi", job_multi)){
+                reply = job.error;
+                return false;
+            }
+            job.get("ant", job_frontend.ant);
+            job.get("res", job_res);
+            job.get("folder", job_folder);
+
+            if(job_refresh > 0) job_refresh = (interlaced) ? job_refresh/2 : job_refresh;
+            else job_refresh = refresh;
+            if(job_rate <= 0 || job_average < 1){
+                reply = "rate and average have to be positive";
+                return false;
+            }
+            if(job_multi < 0 || job_overlap <= 0 || job_overlap > 1){
+                reply = "multi can not be negative and overlap has to be above 0 and at most 1";
+                return false;
+            }
+
+            int job_width, job_height;
+            if(!parseResolution(job_res, job_refresh, exact_resolution, job_width, job_height)){
+                reply = "unknown resolution "+job_res;
+                return false;
+            }
+
+            // only what changed since the last job goes to the receiver
+            if(wideband <= 0) job_frontend.rate = job_rate;
+            if(usrp){
+                if(applyFrontend(usrp, channels, job_frontend, applied_frontend)){
+                    // the frontend settles again, and the scheduled sources get streamers (and settling) for it
+                    for(size_t chan : channels){
+                        check_locked_sensor(usrp->get_rx_sensor_names(chan),
+                            "lo_locked",
+                            [usrp, chan](const std::string& sensor_name) {
+                                return usrp->get_rx_sensor(sensor_name, chan);
+                            },
+                            setup_time);
+                    }
+
+                    if(!receiver_sources.empty()){
+                        receiver_sources.clear();
+                        for(size_t chan : channels){
+                            shared_ptr<tmpst::uhdSource> source = make_shared<tmpst::uhdSource>(usrp, chan, settle);
+                            if(settle <= 0) source->measureSettling(job_freq, job_lo_offset);
+                            receiver_sources.push_back(source);
+                        }
+                    }
+                }
+            }else if(job_frontend.rate != frontend.rate){
+                reply = "the simulated receiver has a fixed rate";
+                return false;
+            }
+
+            if(!job_folder.empty() && job_folder.back() != '/') job_folder += '/';
+            mkdir(job_folder.c_str(), 0755);
+
+            unique_ptr<tmpst::tempest> job_tempest(new tmpst::tempest(usrp, job_folder, job_width, job_height, job_refresh,
+                                                                      job_multi, job_average, job_overlap, job_freq, job_rate,
+                                                                      job_lo_offset, channel, frame_ignore, shift_max,
+                                                                      inverted, interlaced, verbose));
+            if(!receiver_sources.empty()) job_tempest->setSources(receiver_sources);
+            configure(job_tempest.get());
+
+            job_tempest->initializeBands();
+            if(!job_tempest->processBands()){
+                reply = "not every band was received or loaded";
+                return false;
+            }
+            job_tempest->combineBands();
+            tmpst::imageWriter::shared().flush(); // the image is on disk before the reply
+
+            reply = job_folder+"combined_bands"+tmpst::imageWriter::shared().extension();
+            return true;
+        });
+
+        if(!server.open()) return -1;
+        signal(SIGINT, [](int){ tmpst::daemonServer::stop(); });
+        server.serve();
+        tmpst::imageWriter::shared().finish();
+
+        if(var_map.count("trace")){
+            tmpst::trace::summary(cout);
+            if(tmpst::trace::write(trace_file)) cout << "Trace written to " << trace_file << endl;
+        }
+        return 0;
+    }
+
+    if(var_map.count("detect")){
+        main_tempest->detectResolution(detect_seconds, detect_top);
+
+        delete main_tempest;
+        return 0;
+    }
+
+    if(var_map.count("live")){
+        // ctrl-c stops the stream cleanly
+        signal(SIGINT, [](int){ tmpst::tempest::stopLive(); });
+        main_tempest->processLive(live_rate, live_count);
+        tmpst::imageWriter::shared().finish();
+
+        delete main_tempest;
+        return 0;
+    }
+
+    if(var_map.count("from_cache")){
+        if(!main_tempest->processCache(cache_file)){
+            delete main_tempest;
+            return -1;
+        }
+    }else{
+        main_tempest->initializeBands();
+        main_tempest->processBands();
+    }
     main_tempest->combineBands();
+    tmpst::imageWriter::shared().finish(); // every image is on disk from here
+
+    if(var_map.count("trace")){
+        tmpst::trace::summary(cout);
+        if(tmpst::trace::write(trace_file)) cout << "Trace written to " << trace_file << endl;
+    }
+
+    for(size_t c=0; c<simulated.size(); c++)
+        cout << "Simulated channel " << c << ": " << simulated[c]->unsettled_samples << " samples before the LO settled, "
+             << simulated[c]->late_commands << " late commands, " << simulated[c]->overflows << " overflows, "
+             << simulated[c]->timeouts << " timeouts, " << simulated[c]->idle_seconds << "s waiting on samples" << endl;
 
     delete main_tempest;
 
@@ -0,0 +1,454 @@
+#include "kernels.h"
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <immintrin.h>
+
+using namespace std;
+
+namespace tmpst{
+    namespace kernels{
+
+        // ===================================================================================
+        // ================================== SCALAR =========================================
+        // ===================================================================================
+
+        /**
+         * Reference versions, every vector version has to give exactly the same answers.
+         * I*I+Q*Q is done in unsigned 32 bits as both being -32768 overflows an int.
+         */
+        static void magnitudeScalar(const short * iq, unsigned short * out, size_t count){
+            for(size_t i=0; i<count; i++){
+                uint32_t power = uint32_t(iq[2*i]*iq[2*i]) + uint32_t(iq[2*i+1]*iq[2*i+1]);
+                out[i] = (unsigned short) sqrt(double(power));
+            }
+        }
+
+        static uint64_t dotScalar(const unsigned short * one, const unsigned short * two, size_t count){
+            uint64_t answer = 0;
+            for(size_t i=0; i<count; i++)
+                answer += uint32_t(one[i])*uint32_t(two[i]);
+            return answer;
+        }
+
+        static void accumulateScalar(const unsigned short * samples, float * sum, size_t count, float scale){
+            for(size_t i=0; i<count; i++){
+                float scaled = float(samples[i])*scale;
+                sum[i] += scaled;
+            }
+        }
+
+        static void trimmedMeanScalar(const unsigned short * const * frames, size_t frame_count, size_t trim,
+                                      float * out, size_t count){
+            vector<unsigned short> storage(frame_count);
+            unsigned short * values = storage.data();
+            float scale = 1.0f/float(frame_count-2*trim);
+
+            for(size_t i=0; i<count; i++){
+                for(size_t k=0; k<frame_count; k++) values[k] = frames[k][i];
+
+                if(frame_count > MAX_SORT_FRAMES){
+                    sort(values, values+frame_count);
+                }else for(size_t k=1; k<frame_count; k++){ // insertion sort, the frames are few
+                    unsigned short value = values[k];
+                    size_t j = k;
+                    for(; j>0 && values[j-1]>value; j--) values[j] = values[j-1];
+                    values[j] = value;
+                }
+
+                float sum = 0;
+                for(size_t k=trim; k<frame_count-trim; k++) sum += float(values[k]);
+                out[i] = sum*scale;
+            }
+        }
+
+        // ===================================================================================
+        // =================================== SSE2 ==========================================
+        // ===================================================================================
+
+        __attribute__((target("sse2")))
+        static __m128d unsignedToDoubleSSE2(__m128i value){
+            // madd results are unsigned, but the conversion is signed
+            __m128d converted = _mm_cvtepi32_pd(value);
+            __m128d negative = _mm_cmplt_pd(converted, _mm_setzero_pd());
+            return _mm_add_pd(converted, _mm_and_pd(negative, _mm_set1_pd(4294967296.0)));
+        }
+
+        __attribute__((target("sse2")))
+        static void magnitudeSSE2(const short * iq, unsigned short * out, size_t count){
+            const __m128i bias32 = _mm_set1_epi32(32768);
+            const __m128i bias16 = _mm_set1_epi16(short(0x8000));
+
+            size_t i = 0;
+            for(; i+8<=count; i+=8){
+                __m128i first = _mm_loadu_si128((const __m128i *)(iq+2*i));
+                __m128i second = _mm_loadu_si128((const __m128i *)(iq+2*i+8));
+
+                __m128i power[2] = {_mm_madd_epi16(first, first), _mm_madd_epi16(second, second)};
+                __m128i roots[2];
+
+                for(int p=0; p<2; p++){
+                    __m128d low = _mm_sqrt_pd(unsignedToDoubleSSE2(power[p]));
+                    __m128d high = _mm_sqrt_pd(unsignedToDoubleSSE2(_mm_shuffle_epi32(power[p], _MM_SHUFFLE(1,0,3,2))));
+                    roots[p] = _mm_unpacklo_epi64(_mm_cvttpd_epi32(low), _mm_cvttpd_epi32(high));
+                }
+
+                // no unsigned pack in sse2, so shift to signed range and back
+                __m128i packed = _mm_packs_epi32(_mm_sub_epi32(roots[0], bias32), _mm_sub_epi32(roots[1], bias32));
+                _mm_storeu_si128((__m128i *)(out+i), _mm_xor_si128(packed, bias16));
+            }
+
+            magnitudeScalar(iq+2*i, out+i, count-i);
+        }
+
+        __attribute__((target("sse2")))
+        static uint64_t dotSSE2(const unsigned short * one, const unsigned short * two, size_t count){
+            const __m128i zero = _mm_setzero_si128();
+            __m128i total = _mm_setzero_si128();
+
+            size_t i = 0;
+            for(; i+8<=count; i+=8){
+                __m128i a = _mm_loadu_si128((const __m128i *)(one+i));
+                __m128i b = _mm_loadu_si128((const __m128i *)(two+i));
+
+                __m128i low = _mm_mullo_epi16(a, b);
+                __m128i high = _mm_mulhi_epu16(a, b);
+                __m128i products[2] = {_mm_unpacklo_epi16(low, high), _mm_unpackhi_epi16(low, high)};
+
+                for(int p=0; p<2; p++){
+                    total = _mm_add_epi64(total, _mm_unpacklo_epi32(products[p], zero));
+                    total = _mm_add_epi64(total, _mm_unpackhi_epi32(products[p], zero));
+                }
+            }
+
+            uint64_t lanes[2];
+            _mm_storeu_si128((__m128i *)lanes, total);
+
+            return lanes[0] + lanes[1] + dotScalar(one+i, two+i, count-i);
+        }
+
+        __attribute__((target("sse2")))
+        static void accumulateSSE2(const unsigned short * samples, float * sum, size_t count, float scale){
+            const __m128i zero = _mm_setzero_si128();
+            const __m128 factor = _mm_set1_ps(scale);
+
+            size_t i = 0;
+            for(; i+8<=count; i+=8){
+                __m128i values = _mm_loadu_si128((const __m128i *)(samples+i));
+                __m128 low = _mm_cvtepi32_ps(_mm_unpacklo_epi16(values, zero));
+                __m128 high = _mm_cvtepi32_ps(_mm_unpackhi_epi16(values, zero));
+
+                _mm_storeu_ps(sum+i, _mm_add_ps(_mm_loadu_ps(sum+i), _mm_mul_ps(low, factor)));
+                _mm_storeu_ps(sum+i+4, _mm_add_ps(_mm_loadu_ps(sum+i+4), _mm_mul_ps(high, factor)));
+            }
+
+            accumulateScalar(samples+i, sum+i, count-i, scale);
+        }
+
+        /**
+         * Sorting network across the frames (odd-even transposition), 8 samples at a time.
+         * SSE2 has no unsigned 16 bit min/max, a saturating subtract gives both.
+         */
+        __attribute__((target("sse2")))
+        static void trimmedMeanSSE2(const unsigned short * const * frames, size_t frame_count, size_t trim,
+                                    float * out, size_t count){
+            const __m128i zero = _mm_setzero_si128();
+            const __m128 scale = _mm_set1_ps(1.0f/float(frame_count-2*trim));
+            __m128i values[MAX_SORT_FRAMES];
+
+            size_t i = 0;
+            for(; i+8<=count; i+=8){
+                for(size_t k=0; k<frame_count; k++) values[k] = _mm_loadu_si128((const __m128i *)(frames[k]+i));
+
+                for(size_t round=0; round<frame_count; round++){
+                    for(size_t k=round&1; k+1<frame_count; k+=2){
+                        __m128i over = _mm_subs_epu16(values[k], values[k+1]);
+                        values[k] = _mm_sub_epi16(values[k], over);
+                        values[k+1] = _mm_add_epi16(values[k+1], over);
+                    }
+                }
+
+                __m128 low = _mm_setzero_ps(), high = _mm_setzero_ps();
+                for(size_t k=trim; k<frame_count-trim; k++){
+                    low = _mm_add_ps(low, _mm_cvtepi32_ps(_mm_unpacklo_epi16(values[k], zero)));
+                    high = _mm_add_ps(high, _mm_cvtepi32_ps(_mm_unpackhi_epi16(values[k], zero)));
+                }
+                _mm_storeu_ps(out+i, _mm_mul_ps(low, scale));
+                _mm_storeu_ps(out+i+4, _mm_mul_ps(high, scale));
+            }
+
+            const unsigned short * rest[MAX_SORT_FRAMES];
+            for(size_t k=0; k<frame_count; k++) rest[k] = frames[k]+i;
+            trimmedMeanScalar(rest, frame_count, trim, out+i, count-i);
+        }
+
+        // ===================================================================================
+        // =================================== AVX2 ==========================================
+        // ===================================================================================
+
+        __attribute__((target("avx2")))
+        static __m256d unsignedToDoubleAVX2(__m128i value){
+            __m256d converted = _mm256_cvtepi32_pd(value);
+            __m256d negative = _mm256_cmp_pd(converted, _mm256_setzero_pd(), _CMP_LT_OQ);
+            return _mm256_add_pd(converted, _mm256_and_pd(negative, _mm256_set1_pd(4294967296.0)));
+        }
+
+        __attribute__((target("avx2")))
+        static void magnitudeAVX2(const short * iq, unsigned short * out, size_t count){
+            size_t i = 0;
+            for(; i+8<=count; i+=8){
+                __m256i values = _mm256_loadu_si256((const __m256i *)(iq+2*i));
+                __m256i power = _mm256_madd_epi16(values, values);
+
+                __m256d low = _mm256_sqrt_pd(unsignedToDoubleAVX2(_mm256_castsi256_si128(power)));
+                __m256d high = _mm256_sqrt_pd(unsignedToDoubleAVX2(_mm256_extracti128_si256(power, 1)));
+
+                __m128i packed = _mm_packus_epi32(_mm256_cvttpd_epi32(low), _mm256_cvttpd_epi32(high));
+                _mm_storeu_si128((__m128i *)(out+i), packed);
+            }
+
+            magnitudeScalar(iq+2*i, out+i, count-i);
+        }
+
+        __attribute__((target("avx2")))
+        static uint64_t dotAVX2(const unsigned short * one, const unsigned short * two, size_t count){
+            const __m256i zero = _mm256_setzero_si256();
+            __m256i total = _mm256_setzero_si256();
+
+            size_t i = 0;
+            for(; i+16<=count; i+=16){
+                __m256i a = _mm256_loadu_si256((const __m256i *)(one+i));
+                __m256i b = _mm256_loadu_si256((const __m256i *)(two+i));
+
+                __m256i low = _mm256_mullo_epi16(a, b);
+                __m256i high = _mm256_mulhi_epu16(a, b);
+                __m256i products[2] = {_mm256_unpacklo_epi16(low, high), _mm256_unpackhi_epi16(low, high)};
+
+                for(int p=0; p<2; p++){
+                    total = _mm256_add_epi64(total, _mm256_unpacklo_epi32(products[p], zero));
+                    total = _mm256_add_epi64(total, _mm256_unpackhi_epi32(products[p], zero));
+                }
+            }
+
+            uint64_t lanes[4];
+            _mm256_storeu_si256((__m256i *)lanes, total);
+
+            return lanes[0] + lanes[1] + lanes[2] + lanes[3] + dotScalar(one+i, two+i, count-i);
+        }
+
+        __attribute__((target("avx2")))
+        static void accumulateAVX2(const unsigned short * samples, float * sum, size_t count, float scale){
+            const __m256 factor = _mm256_set1_ps(scale);
+
+            size_t i = 0;
+            for(; i+8<=count; i+=8){
+                __m128i values = _mm_loadu_si128((const __m128i *)(samples+i));
+                __m256 converted = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(values));
+
+                _mm256_storeu_ps(sum+i, _mm256_add_ps(_mm256_loadu_ps(sum+i), _mm256_mul_ps(converted, factor)));
+            }
+
+            accumulateScalar(samples+i, sum+i, count-i, scale);
+        }
+
+        __attribute__((target("avx2")))
+        static void trimmedMeanAVX2(const unsigned short * const * frames, size_t frame_count, size_t trim,
+                                    float * out, size_t count){
+            const __m256 scale = _mm256_set1_ps(1.0f/float(frame_count-2*trim));
+            __m256i values[MAX_SORT_FRAMES];
+
+            size_t i = 0;
+            for(; i+16<=count; i+=16){
+                for(size_t k=0; k<frame_count; k++) values[k] = _mm256_loadu_si256((const __m256i *)(frames[k]+i));
+
+                for(size_t round=0; round<frame_count; round++){
+                    for(size_t k=round&1; k+1<frame_count; k+=2){
+                        __m256i smaller = _mm256_min_epu16(values[k], values[k+1]);
+                        values[k+1] = _mm256_max_epu16(values[k], values[k+1]);
+                        values[k] = smaller;
+                    }
+                }
+
+                __m256 low = _mm256_setzero_ps(), high = _mm256_setzero_ps();
+                for(size_t k=trim; k<frame_count-trim; k++){
+                    low = _mm256_add_ps(low, _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(values[k]))));
+                    high = _mm256_add_ps(high, _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(values[k], 1))));
+                }
+                _mm256_storeu_ps(out+i, _mm256_mul_ps(low, scale));
+                _mm256_storeu_ps(out+i+8, _mm256_mul_ps(high, scale));
+            }
+
+            const unsigned short * rest[MAX_SORT_FRAMES];
+            for(size_t k=0; k<frame_count; k++) rest[k] = frames[k]+i;
+            trimmedMeanScalar(rest, frame_count, trim, out+i, count-i);
+        }
+
+        // ===================================================================================
+        // ================================== AVX-512 ========================================
+        // ===================================================================================
+
+        __attribute__((target("avx512f,avx512bw")))
+        static void magnitudeAVX512(const short * iq, unsigned short * out, size_t count){
+            size_t i = 0;
+            for(; i+16<=count; i+=16){
+                __m512i values = _mm512_loadu_si512((const void *)(iq+2*i));
+                __m512i power = _mm512_madd_epi16(values, values);
+
+                __m512d low = _mm512_sqrt_pd(_mm512_cvtepu32_pd(_mm512_castsi512_si256(power)));
+                __m512d high = _mm512_sqrt_pd(_mm512_cvtepu32_pd(_mm512_extracti64x4_epi64(power, 1)));
+
+                __m512i roots = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvttpd_epi32(low)),
+                                                   _mm512_cvttpd_epi32(high), 1);
+                _mm256_storeu_si256((__m256i *)(out+i), _mm512_cvtepi32_epi16(roots));
+            }
+
+            magnitudeScalar(iq+2*i, out+i, count-i);
+        }
+
+        __attribute__((target("avx512f,avx512bw")))
+        static uint64_t dotAVX512(const unsigned short * one, const unsigned short * two, size_t count){
+            const __m512i zero = _mm512_setzero_si512();
+            __m512i total = _mm512_setzero_si512();
+
+            size_t i = 0;
+            for(; i+32<=count; i+=32){
+                __m512i a = _mm512_loadu_si512((const void *)(one+i));
+                __m512i b = _mm512_loadu_si512((const void *)(two+i));
+
+                __m512i low = _mm512_mullo_epi16(a, b);
+                __m512i high = _mm512_mulhi_epu16(a, b);
+                __m512i products[2] = {_mm512_unpacklo_epi16(low, high), _mm512_unpackhi_epi16(low, high)};
+
+                for(int p=0; p<2; p++){
+                    total = _mm512_add_epi64(total, _mm512_unpacklo_epi32(products[p], zero));
+                    total = _mm512_add_epi64(total, _mm512_unpackhi_epi32(products[p], zero));
+                }
+            }
+
+            return uint64_t(_mm512_reduce_add_epi64(total)) + dotScalar(one+i, two+i, count-i);
+        }
+
+        __attribute__((target("avx512f,avx512bw")))
+        static void accumulateAVX512(const unsigned short * samples, float * sum, size_t count, float scale){
+            const __m512 factor = _mm512_set1_ps(scale);
+
+            size_t i = 0;
+            for(; i+16<=count; i+=16){
+                __m256i values = _mm256_loadu_si256((const __m256i *)(samples+i));
+                __m512 converted = _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(values));
+
+                _mm512_storeu_ps(sum+i, _mm512_add_ps(_mm512_loadu_ps(sum+i), _mm512_mul_ps(converted, factor)));
+            }
+
+            accumulateScalar(samples+i, sum+i, count-i, scale);
+        }
+
+        __attribute__((target("avx512f,avx512bw")))
+        static void trimmedMeanAVX512(const unsigned short * const * frames, size_t frame_count, size_t trim,
+                                      float * out, size_t count){
+            const __m512 scale = _mm512_set1_ps(1.0f/float(frame_count-2*trim));
+            __m512i values[MAX_SORT_FRAMES];
+
+            size_t i = 0;
+            for(; i+32<=count; i+=32){
+                for(size_t k=0; k<frame_count; k++) values[k] = _mm512_loadu_si512((const void *)(frames[k]+i));
+
+                for(size_t round=0; round<frame_count; round++){
+                    for(size_t k=round&1; k+1<frame_count; k+=2){
+                        __m512i smaller = _mm512_min_epu16(values[k], values[k+1]);
+                        values[k+1] = _mm512_max_epu16(values[k], values[k+1]);
+                        values[k] = smaller;
+                    }
+                }
+
+                __m512 low = _mm512_setzero_ps(), high = _mm512_setzero_ps();
+                for(size_t k=trim; k<frame_count-trim; k++){
+                    low = _mm512_add_ps(low, _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm512_castsi512_si256(values[k]))));
+                    high = _mm512_add_ps(high, _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm512_extracti64x4_epi64(values[k], 1))));
+                }
+                _mm512_storeu_ps(out+i, _mm512_mul_ps(low, scale));
+                _mm512_storeu_ps(out+i+16, _mm512_mul_ps(high, scale));
+            }
+
+            const unsigned short * rest[MAX_SORT_FRAMES];
+            for(size_t k=0; k<frame_count; k++) rest[k] = frames[k]+i;
+            trimmedMeanScalar(rest, frame_count, trim, out+i, count-i);
+        }
+
+        // ===================================================================================
+        // ================================= DISPATCH ========================================
+        // ===================================================================================
+
+        struct kernelTable{
+            simdLevel level;
+            void (*magnitude)(const short *, unsigned short *, size_t);
+            uint64_t (*dot)(const unsigned short *, const unsigned short *, size_t);
+            void (*accumulate)(const unsigned short *, float *, size_t, float);
+            void (*trimmedMean)(const unsigned short * const *, size_t, size_t, float *, size_t);
+        };
+
+        static const kernelTable tables[] = {
+            {SIMD_SCALAR,   magnitudeScalar,    dotScalar,  accumulateScalar,   trimmedMeanScalar},
+            {SIMD_SSE2,     magnitudeSSE2,      dotSSE2,    accumulateSSE2,     trimmedMeanSSE2},
+            {SIMD_AVX2,     magnitudeAVX2,      dotAVX2,    accumulateAVX2,     trimmedMeanAVX2},
+            {SIMD_AVX512,   magnitudeAVX512,    dotAVX512,  accumulateAVX512,   trimmedMeanAVX512}
+        };
+
+        /**
+         * Finds the best instruction set the cpu supports (CPUID)
+         */
+        simdLevel detectLevel(){
+            __builtin_cpu_init();
+            if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return SIMD_AVX512;
+            if(__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+            if(__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+            return SIMD_SCALAR;
+        }
+
+        static const kernelTable * active(){
+            static const kernelTable * table = &tables[detectLevel()];
+            return table;
+        }
+
+        static const kernelTable * forced = NULL;
+
+        static inline const kernelTable * table(){
+            return (forced) ? forced : active();
+        }
+
+        simdLevel currentLevel(){ return table()->level; }
+
+        void useLevel(simdLevel level){
+            if(level > detectLevel()) level = detectLevel();
+            forced = &tables[level];
+        }
+
+        const char * levelName(simdLevel level){
+            switch(level){
+                case SIMD_SSE2:     return "sse2";
+                case SIMD_AVX2:     return "avx2";
+                case SIMD_AVX512:   return "avx512";
+                default:            return "scalar";
+            }
+        }
+
+        void magnitude(const short * iq, unsigned short * out, size_t count){
+            table()->magnitude(iq, out, count);
+        }
+
+        uint64_t dot(const unsigned short * one, const unsigned short * two, size_t count){
+            return table()->dot(one, two, count);
+        }
+
+        void accumulate(const unsigned short * samples, float * sum, size_t count, float scale){
+            table()->accumulate(samples, sum, count, scale);
+        }
+
+        void trimmedMean(const unsigned short * const * frames, size_t frame_count, size_t trim, float * out, size_t count){
+            if(frame_count == 0 || 2*trim >= frame_count) return;
+            if(frame_count > MAX_SORT_FRAMES) trimmedMeanScalar(frames, frame_count, trim, out, count);
+            else table()->trimmedMean(frames, frame_count, trim, out, count);
+        }
+
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef _KERNELS_H_
+#define _KERNELS_H_
+#include <cstddef>
+#include <cstdint>
+
+namespace tmpst{
+    namespace kernels{
+
+        // instruction sets the kernels are compiled for, in order of preference
+        enum simdLevel{
+            SIMD_SCALAR,
+            SIMD_SSE2,
+            SIMD_AVX2,
+            SIMD_AVX512
+        };
+
+        simdLevel detectLevel();
+        simdLevel currentLevel();
+        void useLevel(simdLevel level); // forces a level (clamped to what the cpu supports)
+        const char * levelName(simdLevel level);
+
+        // interleaved sc16 IQ samples to truncated magnitudes (count is the amount of IQ pairs)
+        void magnitude(const short * iq, unsigned short * out, size_t count);
+
+        // dot product of two sample arrays, accumulated in 64 bits so it never saturates
+        uint64_t dot(const unsigned short * one, const unsigned short * two, size_t count);
+
+        // sum[i] += samples[i]*scale
+        void accumulate(const unsigned short * samples, float * sum, size_t count, float scale);
+
+        // out[i] = mean of frames[*][i] after dropping the trim smallest and trim largest (trim (n-1)/2 is the median)
+        // more than MAX_SORT_FRAMES frames are sorted one sample at a time
+        const size_t MAX_SORT_FRAMES = 64;
+        void trimmedMean(const unsigned short * const * frames, size_t frame_count, size_t trim, float * out, size_t count);
+
+    }
+}
+
+#endif
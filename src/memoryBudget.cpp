@@ -0,0 +1,89 @@
+#include "memoryBudget.h"
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+namespace tmpst{
+
+    memoryBudget::memoryBudget(): limit(0), in_use(0), peak(0), holders(0), peak_holders(0) {};
+
+    void memoryBudget::setLimit(size_t bytes){
+        lock_guard<mutex> guard(lock);
+        limit = bytes;
+        freed.notify_all();
+    }
+
+    size_t memoryBudget::getLimit(){ return limit; }
+
+    void memoryBudget::reserve(size_t bytes, bool wait){
+        unique_lock<mutex> guard(lock);
+        if(wait) freed.wait(guard, [this, bytes]{ return limit == 0 || holders == 0 || in_use+bytes <= limit; });
+
+        in_use += bytes;
+        holders++;
+        peak = max(peak, in_use);
+        peak_holders = max(peak_holders, holders);
+    }
+
+    /**
+     * For holders that are filled at the same time (a round of channels): waits for room for all of them
+     * together, or for an empty budget when the group is bigger than the limit. Each one is released on its own.
+     */
+    void memoryBudget::reserveGroup(size_t bytes, int count, bool wait){
+        if(count <= 0) return;
+        unique_lock<mutex> guard(lock);
+        size_t total = bytes*count;
+        if(wait) freed.wait(guard, [this, total]{ return limit == 0 || holders == 0 || in_use+min(total, limit) <= limit; });
+
+        in_use += total;
+        holders += count;
+        peak = max(peak, in_use);
+        peak_holders = max(peak_holders, holders);
+    }
+
+    void memoryBudget::release(size_t bytes){
+        lock_guard<mutex> guard(lock);
+        in_use -= min(bytes, in_use);
+        holders = max(holders-1, 0);
+        freed.notify_all();
+    }
+
+    size_t memoryBudget::inUse(){
+        lock_guard<mutex> guard(lock);
+        return in_use;
+    }
+
+    size_t memoryBudget::peakUse(){
+        lock_guard<mutex> guard(lock);
+        return peak;
+    }
+
+    int memoryBudget::peakHolders(){
+        lock_guard<mutex> guard(lock);
+        return peak_holders;
+    }
+
+    /**
+     * Reads sizes like 512M, 16G or plain bytes (K, M and G are powers of 1024)
+     */
+    size_t memoryBudget::parseSize(string size){
+        if(size.empty()) return 0;
+
+        size_t multiplier = 1;
+        switch(toupper(size.back())){
+            case 'K': multiplier = size_t(1)<<10; break;
+            case 'M': multiplier = size_t(1)<<20; break;
+            case 'G': multiplier = size_t(1)<<30; break;
+        }
+        if(multiplier != 1) size.pop_back();
+
+        try{
+            return size_t(stod(size)*multiplier);
+        }catch(exception& e){
+            cerr << "Memory size " << size << " could not be read, use something like 512M or 16G" << endl;
+            return 0;
+        }
+    }
+
+}
@@ -0,0 +1,45 @@
+#ifndef _MEMORYBUDGET_H_
+#define _MEMORYBUDGET_H_
+#include <mutex>
+#include <condition_variable>
+#include <string>
+
+namespace tmpst{
+
+    /**
+     * Keeps count of the sample memory held by every band in flight.
+     * reserve waits until the bytes fit under the limit (a limit of 0 never waits),
+     * a reservation is always let through when nothing else is held so one band bigger
+     * than the budget still gets processed. Without wait the bytes are only counted, for
+     * holders that nothing else could make room for.
+     */
+    class memoryBudget{
+    private:
+        size_t limit;
+        size_t in_use;
+        size_t peak;
+        int holders;            // reservations currently held
+        int peak_holders;
+
+        std::mutex lock;
+        std::condition_variable freed;
+
+    public:
+        memoryBudget();
+
+        void setLimit(size_t bytes);
+        size_t getLimit();
+
+        void reserve(size_t bytes, bool wait);
+        void reserveGroup(size_t bytes, int count, bool wait);  // count holders of bytes each, at once
+        void release(size_t bytes);
+
+        size_t inUse();
+        size_t peakUse();
+        int peakHolders();
+
+        static size_t parseSize(std::string size);
+    };
+
+}
+#endif
@@ -0,0 +1,149 @@
+#include "rasterizer.h"
+#include <opencv2/core/utility.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <memory>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <cmath>
+
+using namespace cv;
+using namespace std;
+
+namespace tmpst{
+
+    namespace{
+
+        /**
+         * Where the pixels of one size of image come from
+         */
+        struct layout{
+            long samples;
+            int width, height;
+            bool interlaced;
+
+            vector<int> index;      // per pixel of the stretched frame: the sample on its left
+            vector<float> weight;   // and how much of the sample on its right is mixed in
+            vector<int> rows;       // per image row: the row of the stretched frame it shows
+        };
+
+        /**
+         * Same sample positions resize uses for linear interpolation
+         */
+        shared_ptr<const layout> makeLayout(long samples, int width, int height, bool interlaced){
+            shared_ptr<layout> table = make_shared<layout>();
+            table->samples = samples;
+            table->width = width;
+            table->height = height;
+            table->interlaced = interlaced;
+
+            long pixels = long(width)*height;
+            table->index.resize(pixels);
+            table->weight.resize(pixels);
+
+            double scale = double(samples)/pixels;
+            for(long k=0; k<pixels; k++){
+                float position = float((k+0.5)*scale - 0.5);
+                long left = (long) floor(position);
+                float right_weight = position - left;
+
+                if(left < 0){
+                    left = 0;
+                    right_weight = 0;
+                }
+                if(left >= samples-1){
+                    // last sample on its own (read as the right side so left+1 stays in range)
+                    left = max(samples-2, 0L);
+                    right_weight = (samples > 1) ? 1 : 0;
+                }
+
+                table->index[k] = left;
+                table->weight[k] = right_weight;
+            }
+
+            // reconInterlace: the even rows are in the first half of the frame, the odd rows in the second
+            table->rows.resize(height);
+            for(int n=0; n<height; n++)
+                table->rows[n] = (interlaced) ? n/2 + ((height+1)/2)*(n%2) : n;
+
+            return table;
+        }
+
+        /**
+         * The last few layouts, every band of a run uses the same one
+         */
+        shared_ptr<const layout> findLayout(long samples, int width, int height, bool interlaced){
+            static mutex cache_lock;
+            static deque<shared_ptr<const layout>> cache;
+            const size_t cache_size = 4;
+
+            lock_guard<mutex> guard(cache_lock);
+            for(auto & table : cache){
+                if(table->samples == samples && table->width == width && table->height == height && table->interlaced == interlaced)
+                    return table;
+            }
+
+            cache.push_front(makeLayout(samples, width, height, interlaced));
+            if(cache.size() > cache_size) cache.pop_back();
+            return cache.front();
+        }
+
+        template<typename T>
+        inline float stretched(const T * samples, const layout & table, long k){
+            float right_weight = table.weight[k];
+            int left = table.index[k];
+            return samples[left]*(1-right_weight) + samples[left+1]*right_weight;
+        }
+
+        template<typename T>
+        void drawSamples(const T * samples, Mat & image, const layout & table, int shift_x, int shift_y){
+            int width = table.width, height = table.height;
+            long pixels = long(width)*height;
+
+            // range for the normalization
+            float low = FLT_MAX, high = -FLT_MAX;
+#pragma omp parallel for reduction(min:low) reduction(max:high)
+            for(long k=0; k<pixels; k++){
+                float value = stretched(samples, table, k);
+                low = min(low, value);
+                high = max(high, value);
+            }
+
+            double scale = (high-low > DBL_EPSILON) ? 255.0/(double(high)-low) : 0;
+            double offset = -low*scale;
+
+            image = Mat(height, width, CV_8U); // new memory, the old image may still be shared
+
+            // the image wraps around when shifted, same as shiftImage
+            int first_column = ((-shift_x)%width + width)%width;
+
+#pragma omp parallel for
+            for(int row=0; row<height; row++){
+                int source_row = table.rows[((row-shift_y)%height + height)%height];
+                long row_start = long(source_row)*width;
+                unsigned char * pixel = image.ptr<unsigned char>(row);
+
+                int column = first_column;
+                for(int c=0; c<width; c++){
+                    pixel[c] = saturate_cast<unsigned char>(stretched(samples, table, row_start+column)*scale + offset);
+                    if(++column == width) column = 0;
+                }
+            }
+        }
+    }
+
+    void rasterize(const Mat & samples, Mat & image, int width, int height, bool interlaced, int shift_x, int shift_y){
+        Mat frame = samples;
+        if(!frame.isContinuous() || (frame.depth() != CV_16U && frame.depth() != CV_32F))
+            samples.convertTo(frame, CV_32F);
+
+        shared_ptr<const layout> table = findLayout(frame.total(), width, height, interlaced);
+
+        if(frame.depth() == CV_16U)
+            drawSamples(frame.ptr<unsigned short>(0), image, *table, shift_x, shift_y);
+        else
+            drawSamples(frame.ptr<float>(0), image, *table, shift_x, shift_y);
+    }
+
+}
@@ -0,0 +1,17 @@
+#ifndef _RASTERIZER_H_
+#define _RASTERIZER_H_
+#include <opencv2/core/utility.hpp>
+
+namespace tmpst{
+
+    /**
+     * Draws a one dimentional frame of samples as a width x height 8 bit image in one pass.
+     * Gives what resize (linear) to width*height, reshape, normalize (0-255 min max), reconInterlace
+     * and shiftImage by (shift_x, shift_y) give one after the other, within rounding.
+     * Where every pixel reads from is kept in a table per samples/width/height/interlaced.
+     */
+    void rasterize(const cv::Mat & samples, cv::Mat & image, int width, int height, bool interlaced,
+                   int shift_x = 0, int shift_y = 0);
+
+}
+#endif
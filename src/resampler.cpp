@@ -0,0 +1,51 @@
+#include "resampler.h"
+#include <cmath>
+
+using namespace std;
+
+namespace tmpst{
+
+    /**
+     * sample with the edges repeated
+     */
+    static inline float tap(const unsigned short * samples, long sample_count, long index){
+        if(index < 0) index = 0;
+        if(index >= sample_count) index = sample_count-1;
+        return samples[index];
+    }
+
+    /**
+     * Evaluates the four Farrow branches for the samples around base and combines them with Horner's rule.
+     * mu is the fractional part of the position (0 <= mu < 1).
+     */
+    static inline double farrow(const unsigned short * samples, long sample_count, long base, double mu){
+        double x0 = tap(samples, sample_count, base-1);
+        double x1 = tap(samples, sample_count, base);
+        double x2 = tap(samples, sample_count, base+1);
+        double x3 = tap(samples, sample_count, base+2);
+
+        double c0 = x1;
+        double c1 = -x0/3 - x1/2 + x2 - x3/6;
+        double c2 = x0/2 - x1 + x2/2;
+        double c3 = -x0/6 + x1/2 - x2/2 + x3/6;
+
+        return ((c3*mu + c2)*mu + c1)*mu + c0;
+    }
+
+    double farrowSample(const unsigned short * samples, long sample_count, double position){
+        long base = floor(position);
+        return farrow(samples, sample_count, base, position-base);
+    }
+
+    void farrowAccumulate(const unsigned short * samples, long sample_count,
+                          double start, double step,
+                          float * sum, int count, float scale){
+
+        for(int k=0; k<count; k++){
+            double position = start + k*step;
+            long base = floor(position);
+            sum[k] += scale*farrow(samples, sample_count, base, position-base);
+        }
+    }
+
+}
@@ -0,0 +1,18 @@
+#ifndef _RESAMPLER_H_
+#define _RESAMPLER_H_
+
+namespace tmpst{
+
+    /**
+     * Cubic (lagrange) Farrow fractional delay filter.
+     * Reads the samples at start, start+step, start+2*step ... and adds them (times scale) to sum.
+     */
+    void farrowAccumulate(const unsigned short * samples, long sample_count,
+                          double start, double step,
+                          float * sum, int count, float scale);
+
+    double farrowSample(const unsigned short * samples, long sample_count, double position);
+
+}
+
+#endif
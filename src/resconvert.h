@@ -4,7 +4,7 @@ using namespace std;
 
 namespace tmpst{
 
-    static map<string, pair<int, int>> resMap = {
+    static const map<string, pair<int, int>> resMap = {
             {"640x400@85",	    {832,445}},
             {"720x400@85",	    {936,446}},
 		    {"640x480@60",	    {800,525}},
@@ -84,15 +84,18 @@ namespace tmpst{
 		    {"2048x1536@60",	{2800,1589}}
     };
 
-    int getWidth(string res, double refresh){
+    // lookups only read the table, so they are safe from several threads (batch workers). 0 is not found
+    inline int getWidth(string res, double refresh){
         string round_ref = to_string(round(refresh));
         string search_string = res+"@"+round_ref.substr(0,round_ref.find("."));
-        return resMap[search_string].first;
+        auto entry = resMap.find(search_string);
+        return (entry == resMap.end()) ? 0 : entry->second.first;
     }
 
-    int getHeight(string res, double refresh){
+    inline int getHeight(string res, double refresh){
         string round_ref = to_string(round(refresh));
         string search_string = res+"@"+round_ref.substr(0,round_ref.find("."));
-        return resMap[search_string].second;
+        auto entry = resMap.find(search_string);
+        return (entry == resMap.end()) ? 0 : entry->second.second;
     }
 }
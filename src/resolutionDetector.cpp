@@ -0,0 +1,128 @@
+#include "resolutionDetector.h"
+#include "resconvert.h"
+#include "extraMath.h"
+#include <opencv2/core/utility.hpp>
+#include <algorithm>
+#include <cmath>
+
+using namespace cv;
+using namespace std;
+
+namespace tmpst{
+
+    resolutionDetector::resolutionDetector(const Mat & magnitudes, double sample_rate): sample_rate(sample_rate){
+        // about 2MHz is plenty to see lines, and keeps the transform small
+        decimation = max(1, int(lround(sample_rate/2e6)));
+
+        // decimated straight from the magnitudes (one row of CV_16U), no full size copy
+        const unsigned short * input = magnitudes.ptr<unsigned short>(0);
+        long count = magnitudes.total()/decimation;
+
+        // twice as long so the correlation does not wrap around
+        int dft_size = getOptimalDFTSize(2*count);
+        Mat signal = Mat::zeros(1, dft_size, CV_64F);
+        double * decimated = signal.ptr<double>(0);
+
+        double total = 0;
+#pragma omp parallel for reduction(+:total)
+        for(long k=0; k<count; k++){
+            uint64_t sum = 0;
+            const unsigned short * block = input+k*decimation;
+            for(int d=0; d<decimation; d++) sum += block[d];
+            decimated[k] = double(sum)/decimation;
+            total += decimated[k];
+        }
+
+        // only the changes matter, not the level
+        double average = (count) ? total/count : 0;
+        for(long k=0; k<count; k++) decimated[k] -= average;
+
+        Mat spectrum, product, lags;
+        dft(signal, spectrum);
+        mulSpectrums(spectrum, spectrum, product, 0, true);
+        idft(product, lags, DFT_SCALE | DFT_REAL_OUTPUT);
+
+        // unbiased (fewer samples overlap at bigger lags), 1 at lag 0
+        const double * correlation = lags.ptr<double>(0);
+        autocorrelation.resize(count/2);
+        for(long lag=0; lag<count/2; lag++)
+            autocorrelation[lag] = (correlation[0] > 0) ? correlation[lag]/correlation[0]*count/(count-lag) : 0;
+    }
+
+    /**
+     * Autocorrelation between two lags
+     */
+    double resolutionDetector::at(double lag){
+        long left = long(floor(lag));
+        if(left < 0 || left+1 >= long(autocorrelation.size())) return 0;
+        double right_weight = lag-left;
+        return autocorrelation[left]*(1-right_weight) + autocorrelation[left+1]*right_weight;
+    }
+
+    /**
+     * Every whole frame later (that fits) should look the same
+     */
+    double resolutionDetector::frameScore(double lag){
+        double sum = 0;
+        int frames = 0;
+        for(int k=1; k<=4 && (k*lag)+1 < autocorrelation.size(); k++, frames++)
+            sum += at(k*lag);
+        return (frames) ? sum/frames : 0;
+    }
+
+    /**
+     * The blanking at the end of every line repeats every line period
+     */
+    double resolutionDetector::lineScore(double frame_lag, int height){
+        double line_lag = frame_lag/height;
+        double sum = 0;
+        for(int m=1; m<=8; m++) sum += at(m*line_lag);
+        return sum/8;
+    }
+
+    /**
+     * Scores every resMap entry (in parallel) and gives the best ones first
+     */
+    vector<resolutionCandidate> resolutionDetector::rank(size_t top){
+        vector<pair<string, pair<int,int>>> entries(resMap.begin(), resMap.end());
+        vector<resolutionCandidate> candidates(entries.size());
+        vector<char> fits(entries.size(), 0);
+
+#pragma omp parallel for schedule(dynamic)
+        for(size_t e=0; e<entries.size(); e++){
+            const string & name = entries[e].first;
+            double nominal = atof(name.substr(name.find('@')+1).c_str());
+
+            // frame period within 1% of the nominal refresh
+            long shortest = long(floor(sample_rate/(nominal*1.01)/decimation));
+            long longest = long(ceil(sample_rate/(nominal*0.99)/decimation));
+            if(shortest < 2 || longest+1 >= long(autocorrelation.size())) continue; // capture too short
+
+            long best = shortest;
+            for(long lag=shortest+1; lag<=longest; lag++)
+                if(autocorrelation[lag] > autocorrelation[best]) best = lag;
+            double lag = best + parabolicPeak(autocorrelation[best-1], autocorrelation[best], autocorrelation[best+1]);
+
+            resolutionCandidate & candidate = candidates[e];
+            candidate.name = name;
+            candidate.width = entries[e].second.first;
+            candidate.height = entries[e].second.second;
+            candidate.refresh = sample_rate/(lag*decimation);
+            candidate.frame_score = frameScore(lag);
+            candidate.line_score = lineScore(lag, candidate.height);
+            candidate.score = candidate.frame_score + candidate.line_score;
+            fits[e] = 1;
+        }
+
+        vector<resolutionCandidate> ranked;
+        for(size_t e=0; e<entries.size(); e++) if(fits[e]) ranked.push_back(candidates[e]);
+
+        sort(ranked.begin(), ranked.end(), [](const resolutionCandidate & a, const resolutionCandidate & b){
+            return a.score > b.score;
+        });
+        if(ranked.size() > top) ranked.resize(top);
+
+        return ranked;
+    }
+
+}
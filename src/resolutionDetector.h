@@ -0,0 +1,41 @@
+#ifndef _RESOLUTIONDETECTOR_H_
+#define _RESOLUTIONDETECTOR_H_
+#include <opencv2/core/utility.hpp>
+#include <string>
+#include <vector>
+
+namespace tmpst{
+
+    struct resolutionCandidate{
+        std::string name;           // resMap entry
+        int width, height;          // total resolution
+        double refresh;             // refresh measured around the entries refresh
+        double frame_score;         // how alike the capture is one frame later
+        double line_score;          // how alike it is one (and a few) lines later
+        double score;
+    };
+
+    /**
+     * Works out the display timing from a capture.
+     * The autocorrelation of the magnitudes is computed once (FFT), after that every resMap entry is
+     * scored by looking it up: the frame period is searched within 1% of the entries refresh and the
+     * line period (frame period / total height) has to line up as well.
+     */
+    class resolutionDetector{
+    private:
+        double sample_rate;
+        int decimation;                     // samples averaged together before correlating
+        std::vector<double> autocorrelation; // normalised, index is the lag in decimated samples
+
+        double at(double lag);
+        double frameScore(double lag);
+        double lineScore(double frame_lag, int height);
+
+    public:
+        resolutionDetector(const cv::Mat & magnitudes, double sample_rate);   // magnitudes are one CV_16U row
+
+        std::vector<resolutionCandidate> rank(size_t top);
+    };
+
+}
+#endif
@@ -0,0 +1,73 @@
+#ifndef _RINGBUFFER_H_
+#define _RINGBUFFER_H_
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+namespace tmpst{
+
+    /**
+     * Lock free ring buffer for one writer (the receiver thread) and one reader.
+     * The writer never waits, old samples are simply overwritten. The reader copies out
+     * the newest samples and can tell if the writer overwrote them while it was copying.
+     */
+    template<typename T>
+    class ringBuffer{
+    private:
+        std::vector<T> buffer;
+        std::atomic<uint64_t> written;  // total samples ever written
+        std::atomic<size_t> largest_span; // biggest write in progress the reader has to allow for
+
+    public:
+        ringBuffer(size_t capacity): buffer(capacity), written(0), largest_span(0) {};
+
+        size_t capacity() const { return buffer.size(); }
+
+        uint64_t total() const { return written.load(std::memory_order_acquire); }
+
+        /**
+         * Space for the next samples, count is lowered if the space would wrap around the end
+         */
+        T * writeSpan(size_t & count){
+            size_t position = written.load(std::memory_order_relaxed) % buffer.size();
+            count = std::min(count, buffer.size()-position);
+            if(count > largest_span.load(std::memory_order_relaxed))
+                largest_span.store(count, std::memory_order_release);
+            return &buffer[position];
+        }
+
+        /**
+         * Makes count samples written to the last span visible to the reader
+         */
+        void commit(size_t count){
+            written.fetch_add(count, std::memory_order_release);
+        }
+
+        /**
+         * Copies the newest count samples into out.
+         * end is set to the total written at the end of the copy window.
+         * returns false if there are not enough samples yet, or they were overwritten while copying
+         */
+        bool copyLatest(T * out, size_t count, uint64_t & end) const{
+            end = total();
+            if(count > buffer.size() || end < count) return false;
+
+            uint64_t start = end-count;
+            size_t position = start % buffer.size();
+            size_t first = std::min(count, buffer.size()-position);
+
+            memcpy(out, &buffer[position], first*sizeof(T));
+            memcpy(out+first, &buffer[0], (count-first)*sizeof(T));
+
+            // keeps the copies above the checks below (an acquire load alone would let them sink past it)
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            // the writer might have lapped us during the copy (or be busy writing over the start)
+            return total()-start + largest_span.load(std::memory_order_acquire) <= buffer.size();
+        }
+    };
+
+}
+#endif
@@ -0,0 +1,23 @@
+#include "sampleArena.h"
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+namespace tmpst{
+
+    sampleArena::sampleArena(size_t slot_size, int slots): slot_size(slot_size), slots(slots){
+        void * aligned = NULL;
+        if(posix_memalign(&aligned, 64, slot_size*slots*sizeof(complex<short>)) != 0)
+            throw bad_alloc();
+
+        memory = (complex<short> *) aligned;
+    }
+
+    sampleArena::~sampleArena(){ free(memory); }
+
+    complex<short> * sampleArena::slot(int index){ return memory + slot_size*index; }
+    size_t sampleArena::slotSize(){ return slot_size; }
+    int sampleArena::slotCount(){ return slots; }
+
+}
@@ -0,0 +1,31 @@
+#ifndef _SAMPLEARENA_H_
+#define _SAMPLEARENA_H_
+#include <complex>
+#include <cstddef>
+
+namespace tmpst{
+
+    /**
+     * Preallocated, cache line aligned IQ memory split into equal slots.
+     * The receiver fills one slot while the samples of another are converted.
+     */
+    class sampleArena{
+    private:
+        std::complex<short> * memory;
+        size_t slot_size;
+        int slots;
+
+        sampleArena(const sampleArena &);               // not copyable
+        sampleArena & operator=(const sampleArena &);
+
+    public:
+        sampleArena(size_t slot_size, int slots);
+        ~sampleArena();
+
+        std::complex<short> * slot(int index);
+        size_t slotSize();
+        int slotCount();
+    };
+
+}
+#endif
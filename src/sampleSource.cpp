@@ -0,0 +1,389 @@
+#include "sampleSource.h"
+#include <uhd/usrp/multi_usrp.hpp>
+#include <algorithm>
+#include <thread>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace tmpst{
+
+    /**
+     * Copies count samples from a repeating buffer, starting at sample position of it
+     */
+    static void copyRepeating(const complex<short> * samples, size_t length, size_t position,
+                              complex<short> * buffer, size_t count){
+        size_t copied = 0;
+        while(copied < count){
+            size_t at = (position+copied)%length;
+            size_t piece = min(count-copied, length-at);
+            memcpy(buffer+copied, samples+at, piece*sizeof(complex<short>));
+            copied += piece;
+        }
+    }
+
+    // ===================================================================================
+    // ================================== UHD SOURCE =====================================
+    // ===================================================================================
+
+    uhdSource::uhdSource(uhd::usrp::multi_usrp::sptr usrp, size_t channel, double settling):
+                        usrp(usrp), channel(channel), settling(settling){
+
+        uhd::stream_args_t stream_arguments("sc16","sc16"); //setting both to complex shorts for efficiency
+
+        // setting up channels
+        vector<size_t> channels;
+        channels.push_back(channel);
+        stream_arguments.channels = channels;
+
+        // get receiver stream obj
+        receiver_stream = usrp->get_rx_stream(stream_arguments);
+    }
+
+    double uhdSource::getTime(){ return usrp->get_time_now().get_real_secs(); }
+    double uhdSource::getRate(){ return usrp->get_rx_rate(channel); }
+    double uhdSource::settlingTime(){ return settling; }
+    size_t uhdSource::maxChunk(){ return receiver_stream->get_max_num_samps(); }
+
+    /**
+     * Retunes at time (as a timed command) or straight away
+     */
+    void uhdSource::tune(double frequency, double offset, double time){
+        uhd::tune_request_t tune_request(frequency, offset);
+
+        if(time >= 0) usrp->set_command_time(uhd::time_spec_t(time));
+        usrp->set_rx_freq(tune_request, channel);
+        if(time >= 0) usrp->clear_command_time();
+    }
+
+    void uhdSource::stream(size_t samples, double time){
+        uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_DONE);
+        stream_cmd.num_samps    = samples;
+        stream_cmd.stream_now   = time < 0;
+        stream_cmd.time_spec    = uhd::time_spec_t((time < 0) ? 0.0 : time);
+        receiver_stream->issue_stream_cmd(stream_cmd);
+    }
+
+    void uhdSource::stop(){
+        uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS);
+        receiver_stream->issue_stream_cmd(stream_cmd);
+    }
+
+    size_t uhdSource::recv(complex<short> * buffer, size_t count, uhd::rx_metadata_t & meta_data, double timeout){
+        return receiver_stream->recv(buffer, count, meta_data, timeout, false);
+    }
+
+    /**
+     * Times how long the LO takes to lock after a retune and keeps double that as the settling time.
+     * Keeps the old value if the device has no lo_locked sensor.
+     */
+    double uhdSource::measureSettling(double frequency, double offset){
+        vector<string> sensor_names = usrp->get_rx_sensor_names(channel);
+        if(find(sensor_names.begin(), sensor_names.end(), "lo_locked") == sensor_names.end())
+            return settling;
+
+        auto start = chrono::steady_clock::now();
+        double elapsed = 0;
+
+        tune(frequency, offset, -1);
+        while(!usrp->get_rx_sensor("lo_locked", channel).to_bool() && elapsed < 1.0){
+            this_thread::sleep_for(chrono::microseconds(100));
+            elapsed = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+        }
+
+        settling = max(2*elapsed, 0.001);
+        return settling;
+    }
+
+    // ===================================================================================
+    // ================================== RECORDINGS =====================================
+    // ===================================================================================
+
+    iqRecording::~iqRecording(){
+        if(mapped) munmap(mapped, bytes);
+    }
+
+    bool iqRecording::open(string filename){
+        int file_descriptor = ::open(filename.c_str(), O_RDONLY);
+        if(file_descriptor < 0){
+            cerr << "Could not open recording: " << filename << endl;
+            return false;
+        }
+
+        struct stat file_stats;
+        if(fstat(file_descriptor, &file_stats) < 0 || file_stats.st_size < long(sizeof(complex<short>))){
+            cerr << "Recording is empty: " << filename << endl;
+            close(file_descriptor);
+            return false;
+        }
+
+        void * new_mapping = mmap(NULL, file_stats.st_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+        close(file_descriptor); // mapping stays valid after closing
+        if(new_mapping == MAP_FAILED){
+            cerr << "Could not memory map recording: " << filename << endl;
+            return false;
+        }
+
+        if(mapped) munmap(mapped, bytes);
+        mapped = new_mapping;
+        bytes = file_stats.st_size;
+        return true;
+    }
+
+    const complex<short> * iqRecording::samples() const { return (const complex<short> *) mapped; }
+    size_t iqRecording::size() const { return bytes/sizeof(complex<short>); }
+
+    playbackSource::playbackSource(double sample_rate):
+                        samples(NULL), length(0),
+                        sample_rate(sample_rate), position(0), burst_samples(0), burst_sent(0) {};
+
+    bool playbackSource::valid(){ return length > 0; }
+
+    double playbackSource::getTime(){ return (position+burst_sent)/sample_rate; }
+    double playbackSource::getRate(){ return sample_rate; }
+    double playbackSource::settlingTime(){ return 0; }
+    size_t playbackSource::maxChunk(){ return 1<<16; }
+
+    void playbackSource::tune(double frequency, double offset, double time){}
+
+    /**
+     * A burst in the future skips the recording on to it
+     */
+    void playbackSource::stream(size_t samples, double time){
+        position += burst_sent;
+        if(time >= 0) position = max(position, size_t(llround(time*sample_rate)));
+
+        burst_samples = samples;
+        burst_sent = 0;
+    }
+
+    void playbackSource::stop(){ burst_samples = burst_sent; }
+
+    size_t playbackSource::recv(complex<short> * buffer, size_t count, uhd::rx_metadata_t & meta_data, double timeout){
+        meta_data.error_code = uhd::rx_metadata_t::ERROR_CODE_NONE;
+
+        if(!valid() || burst_sent >= burst_samples){
+            meta_data.error_code = uhd::rx_metadata_t::ERROR_CODE_TIMEOUT;
+            return 0;
+        }
+
+        size_t chunk = min(min(count, maxChunk()), burst_samples-burst_sent);
+        copyRepeating(samples, length, position+burst_sent, buffer, chunk);
+
+        meta_data.has_time_spec = true;
+        meta_data.time_spec = uhd::time_spec_t(getTime());
+
+        burst_sent += chunk;
+        meta_data.end_of_burst = burst_sent == burst_samples;
+
+        return chunk;
+    }
+
+    fileSource::fileSource(string filename, double sample_rate): playbackSource(sample_rate){
+        if(recording.open(filename)){
+            samples = recording.samples();
+            length = recording.size();
+        }
+    }
+
+    bufferSource::bufferSource(vector<complex<short>> && buffer, double sample_rate):
+                        playbackSource(sample_rate), buffer(move(buffer)){
+        samples = this->buffer.data();
+        length = this->buffer.size();
+    }
+
+    // ===================================================================================
+    // ================================== SIMULATED ======================================
+    // ===================================================================================
+
+    simClock::simClock(bool real_time): real_time(real_time), virtual_time(0), wall_start(chrono::steady_clock::now()) {};
+
+    bool simClock::realTime(){ return real_time; }
+
+    double simClock::now(){
+        if(real_time) return chrono::duration<double>(chrono::steady_clock::now()-wall_start).count();
+
+        lock_guard<mutex> guard(lock);
+        return virtual_time;
+    }
+
+    void simClock::advanceTo(double time){
+        lock_guard<mutex> guard(lock);
+        virtual_time = max(virtual_time, time);
+    }
+
+    void simClock::wait(double seconds){
+        if(real_time){
+            this_thread::sleep_for(chrono::duration<double>(seconds));
+            return;
+        }
+
+        lock_guard<mutex> guard(lock);
+        virtual_time += seconds;
+    }
+
+    simSource::simSource(double sample_rate, double refresh, double retune_latency, bool real_time):
+                        simSource(sample_rate, refresh, retune_latency, make_shared<simClock>(real_time), 1234) {};
+
+    simSource::simSource(double sample_rate, double refresh, double retune_latency, shared_ptr<simClock> clock, unsigned seed):
+                        sample_rate(sample_rate), refresh(refresh),
+                        retune_latency(retune_latency), clock(clock),
+                        settled_at(0), burst_start(0), burst_samples(0), burst_sent(0), late(false),
+                        overflow_chance(0), timeout_chance(0), buffer_time(0),
+                        random(seed),
+                        unsettled_samples(0), late_commands(0), overflows(0), timeouts(0), idle_seconds(0){
+        makePattern();
+    }
+
+    /**
+     * Generates the test pattern once: a few frames (each with its own noise, so averaging still helps)
+     * of a horizontal band and a vertical bar (position within a line, ~600 lines)
+     */
+    void simSource::makePattern(){
+        size_t frame_samples = max(1L, lround(sample_rate/refresh)); // same frame length as frameStream
+        size_t frames = max(size_t(1), min(size_t(8), (size_t(1) << 23)/frame_samples)); // at most 32MB
+
+        normal_distribution<float> noise(0, 100), unsettled(0, 1000);
+
+        pattern.resize(frames*frame_samples);
+        for(size_t k=0; k<pattern.size(); k++){
+            double phase = double(k%frame_samples)/frame_samples;
+            double line_phase = fmod(phase*600, 1.0);
+            bool bright = (phase >= 0.40 && phase < 0.45) || (line_phase >= 0.30 && line_phase < 0.35);
+
+            pattern[k] = complex<short>(short(((bright) ? 2000 : 300) + noise(random)), short(noise(random)));
+        }
+
+        unsettled_noise.resize(65536);
+        for(complex<short> & sample : unsettled_noise)
+            sample = complex<short>(short(unsettled(random)), short(unsettled(random)));
+    }
+
+    bool simSource::replay(string filename){ return recording.open(filename); }
+
+    void simSource::setFaults(double overflow_chance, double timeout_chance, double buffer_time){
+        this->overflow_chance = overflow_chance;
+        this->timeout_chance = timeout_chance;
+        this->buffer_time = buffer_time;
+    }
+
+    /**
+     * count channels of one simulated device (one clock), each with its own noise
+     */
+    vector<shared_ptr<simSource>> simSource::channels(int count, double sample_rate, double refresh,
+                                                      double retune_latency, bool real_time){
+        shared_ptr<simClock> clock = make_shared<simClock>(real_time);
+
+        vector<shared_ptr<simSource>> sources;
+        for(int c=0; c<count; c++)
+            sources.push_back(make_shared<simSource>(sample_rate, refresh, retune_latency, clock, 1234+c));
+        return sources;
+    }
+
+    double simSource::now(){ return clock->now(); }
+
+    double simSource::getTime(){ return now(); }
+    double simSource::getRate(){ return sample_rate; }
+    double simSource::settlingTime(){ return retune_latency*1.1; }
+    size_t simSource::maxChunk(){ return 2000; }
+
+    void simSource::tune(double frequency, double offset, double time){
+        settled_at = ((time < 0) ? now() : time) + retune_latency;
+    }
+
+    void simSource::stream(size_t samples, double time){
+        late = time >= 0 && time < now();
+        burst_start = (time < 0) ? now() : time;
+        burst_samples = samples;
+        burst_sent = 0;
+    }
+
+    void simSource::stop(){ burst_samples = burst_sent; }
+
+    /**
+     * Hands out the next chunk of the burst, once device time has reached the end of it
+     */
+    size_t simSource::recv(complex<short> * buffer, size_t count, uhd::rx_metadata_t & meta_data, double timeout){
+        meta_data.error_code = uhd::rx_metadata_t::ERROR_CODE_NONE;
+
+        if(late){
+            late = false;
+            late_commands++;
+            burst_samples = burst_sent;
+            meta_data.error_code = uhd::rx_metadata_t::ERROR_CODE_LATE_COMMAND;
+            return 0;
+        }
+
+        if(burst_sent >= burst_samples){
+            clock->wait(timeout);
+            meta_data.error_code = uhd::rx_metadata_t::ERROR_CODE_TIMEOUT;
+            return 0;
+        }
+
+        size_t samples = min(min(count, maxChunk()), burst_samples-burst_sent);
+        double chunk_end = burst_start + (burst_sent+samples)/sample_rate;
+
+        // injected faults, and the device buffer running over while the host is behind
+        uniform_real_distribution<double> chance(0, 1);
+        bool behind = clock->realTime() && buffer_time > 0 && now()-chunk_end > buffer_time;
+        if(behind || (overflow_chance > 0 && chance(random) < overflow_chance)){
+            overflows++;
+            burst_samples = burst_sent; // the rest of the burst is lost
+            meta_data.error_code = uhd::rx_metadata_t::ERROR_CODE_OVERFLOW;
+            return 0;
+        }
+        if(timeout_chance > 0 && chance(random) < timeout_chance){
+            timeouts++;
+            clock->wait(timeout);
+            meta_data.error_code = uhd::rx_metadata_t::ERROR_CODE_TIMEOUT;
+            return 0;
+        }
+
+        // the samples only exist once they have been "received"
+        if(clock->realTime()){
+            double wait = chunk_end-now();
+            if(wait > timeout){
+                this_thread::sleep_for(chrono::duration<double>(timeout));
+                idle_seconds += timeout;
+                meta_data.error_code = uhd::rx_metadata_t::ERROR_CODE_TIMEOUT;
+                return 0;
+            }
+            if(wait > 0){
+                this_thread::sleep_for(chrono::duration<double>(wait));
+                idle_seconds += wait;
+            }
+        }else{
+            clock->advanceTo(chunk_end);
+        }
+
+        // device sample number of the chunk, the pattern and the recording line up with it
+        size_t position = size_t(llround(burst_start*sample_rate)) + burst_sent;
+
+        double until_settled = (settled_at-burst_start)*sample_rate - burst_sent;
+        size_t unsettled = (until_settled > 0) ? min(samples, size_t(ceil(until_settled))) : 0;
+        if(unsettled > 0){
+            copyRepeating(unsettled_noise.data(), unsettled_noise.size(), position, buffer, unsettled);
+            unsettled_samples += unsettled;
+        }
+
+        if(recording.size() > 0)
+            copyRepeating(recording.samples(), recording.size(), position+unsettled, buffer+unsettled, samples-unsettled);
+        else
+            copyRepeating(pattern.data(), pattern.size(), position+unsettled, buffer+unsettled, samples-unsettled);
+
+        meta_data.has_time_spec = true;
+        meta_data.time_spec = uhd::time_spec_t(burst_start + burst_sent/sample_rate);
+
+        burst_sent += samples;
+        meta_data.end_of_burst = burst_sent == burst_samples;
+
+        return samples;
+    }
+
+}
@@ -0,0 +1,218 @@
+#ifndef _SAMPLESOURCE_H_
+#define _SAMPLESOURCE_H_
+#include <uhd/usrp/multi_usrp.hpp>
+#include <complex>
+#include <random>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+
+namespace tmpst{
+
+    /**
+     * Where receiver samples come from.
+     * Times are in seconds of device time, a negative time means "now".
+     */
+    class sampleSource{
+    public:
+        virtual ~sampleSource() {};
+
+        virtual double getTime() = 0;
+        virtual double getRate() = 0;
+        virtual double settlingTime() = 0;      // time the LO needs to lock after a retune
+        virtual size_t maxChunk() = 0;          // most samples a single recv returns
+
+        virtual void tune(double frequency, double offset, double time) = 0;
+        virtual void stream(size_t samples, double time) = 0;   // one burst of samples
+        virtual void stop() = 0;
+
+        virtual size_t recv(std::complex<short> * buffer, size_t count, uhd::rx_metadata_t & meta_data, double timeout) = 0;
+    };
+
+    /**
+     * A usrp channel. The streamer is made once and kept for every burst.
+     */
+    class uhdSource : public sampleSource{
+    private:
+        uhd::usrp::multi_usrp::sptr usrp;
+        size_t channel;
+        uhd::rx_streamer::sptr receiver_stream;
+        double settling;
+
+    public:
+        uhdSource(uhd::usrp::multi_usrp::sptr usrp, size_t channel, double settling);
+
+        double getTime();
+        double getRate();
+        double settlingTime();
+        size_t maxChunk();
+
+        void tune(double frequency, double offset, double time);
+        void stream(size_t samples, double time);
+        void stop();
+
+        size_t recv(std::complex<short> * buffer, size_t count, uhd::rx_metadata_t & meta_data, double timeout);
+
+        double measureSettling(double frequency, double offset);
+    };
+
+    /**
+     * A recording of sc16 IQ samples (the --file format), memory mapped
+     */
+    class iqRecording{
+    private:
+        void * mapped;
+        size_t bytes;
+
+    public:
+        iqRecording(): mapped(NULL), bytes(0) {};
+        ~iqRecording();
+        iqRecording(const iqRecording &) = delete;
+        iqRecording & operator=(const iqRecording &) = delete;
+
+        bool open(std::string filename);
+        const std::complex<short> * samples() const;
+        size_t size() const;    // in IQ samples
+    };
+
+    /**
+     * Plays samples already in memory back as fast as they are read.
+     * Retunes do nothing (the samples are one band), every burst carries on where the last one stopped
+     * and the samples start over at their end. Device time is the position in the samples.
+     */
+    class playbackSource : public sampleSource{
+    protected:
+        const std::complex<short> * samples;
+        size_t length;
+
+    private:
+        double sample_rate;
+        size_t position;            // samples played so far
+        size_t burst_samples, burst_sent;
+
+    public:
+        playbackSource(double sample_rate);
+
+        bool valid();
+
+        double getTime();
+        double getRate();
+        double settlingTime();
+        size_t maxChunk();
+
+        void tune(double frequency, double offset, double time);
+        void stream(size_t samples, double time);
+        void stop();
+
+        size_t recv(std::complex<short> * buffer, size_t count, uhd::rx_metadata_t & meta_data, double timeout);
+    };
+
+    /**
+     * Plays a recording (see playbackSource)
+     */
+    class fileSource : public playbackSource{
+    private:
+        iqRecording recording;
+
+    public:
+        fileSource(std::string filename, double sample_rate);
+    };
+
+    /**
+     * Plays a buffer it keeps (eg one channel of a wideband capture, see channelizer)
+     */
+    class bufferSource : public playbackSource{
+    private:
+        std::vector<std::complex<short>> buffer;
+
+    public:
+        bufferSource(std::vector<std::complex<short>> && buffer, double sample_rate);
+    };
+
+    /**
+     * Device time of a simulated device, shared by all of its channels.
+     * Either follows the wall clock (real_time) or jumps ahead as samples are read.
+     */
+    class simClock{
+    private:
+        bool real_time;
+        double virtual_time;
+        std::chrono::steady_clock::time_point wall_start;
+        std::mutex lock;
+
+    public:
+        simClock(bool real_time);
+
+        bool realTime();
+        double now();
+        void advanceTo(double time);    // virtual time never goes back
+        void wait(double seconds);      // sleeps, or jumps ahead by seconds
+    };
+
+    /**
+     * Simulated receiver, for running the sweep without hardware.
+     * The signal is a plain test pattern (bright bars at a fixed place in every frame) plus noise,
+     * its phase follows device time so bands captured on a frame grid all start at the same place.
+     * The pattern (a few frames with their noise) is made up front, so recv only copies and keeps time.
+     * Retunes take retune_latency to settle, samples before that are noise and get counted.
+     * Device time either follows the wall clock (real_time) or jumps ahead as samples are read.
+     * Channels of one device share a simClock (see channels), each has its own LO and streamer.
+     * In place of the test pattern a recording can be replayed (at the position device time says).
+     * Faults can be injected: a chance of an overflow or a timeout on every recv, and with a device
+     * buffer set, an overflow whenever a real time host falls further behind than the buffer holds.
+     * The time recv spends waiting on samples (idle_seconds) is how much headroom the host has left.
+     */
+    class simSource : public sampleSource{
+    private:
+        double sample_rate;
+        double refresh;
+        double retune_latency;
+        std::shared_ptr<simClock> clock;
+
+        double settled_at;          // device time the last retune has settled
+        double burst_start;
+        size_t burst_samples, burst_sent;
+        bool late;
+
+        iqRecording recording;      // replayed when open
+        std::vector<std::complex<short>> pattern;           // whole frames of test pattern and noise, from device sample 0
+        std::vector<std::complex<short>> unsettled_noise;   // played while the lo settles
+        double overflow_chance, timeout_chance;
+        double buffer_time;         // seconds the device holds before overflowing (0 never overflows)
+
+        std::mt19937 random;
+
+        double now();
+        void makePattern();
+
+    public:
+        unsigned long unsettled_samples;
+        unsigned long late_commands;
+        unsigned long overflows, timeouts;
+        double idle_seconds;
+
+        simSource(double sample_rate, double refresh, double retune_latency, bool real_time);
+        simSource(double sample_rate, double refresh, double retune_latency, std::shared_ptr<simClock> clock, unsigned seed);
+
+        bool replay(std::string filename);
+        void setFaults(double overflow_chance, double timeout_chance, double buffer_time);
+
+        static std::vector<std::shared_ptr<simSource>> channels(int count, double sample_rate, double refresh,
+                                                                double retune_latency, bool real_time);
+
+        double getTime();
+        double getRate();
+        double settlingTime();
+        size_t maxChunk();
+
+        void tune(double frequency, double offset, double time);
+        void stream(size_t samples, double time);
+        void stop();
+
+        size_t recv(std::complex<short> * buffer, size_t count, uhd::rx_metadata_t & meta_data, double timeout);
+    };
+
+}
+#endif
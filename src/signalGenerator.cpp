@@ -0,0 +1,136 @@
+#include "signalGenerator.h"
+#include "resconvert.h"
+#include <opencv2/imgproc.hpp>
+#include <random>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <omp.h>
+
+using namespace cv;
+using namespace std;
+
+namespace tmpst{
+
+    signalGenerator::signalGenerator(string resolution, double refresh, double sample_rate):
+                                    refresh(refresh), sample_rate(sample_rate){
+
+        width = tmpst::getWidth(resolution, refresh);
+        height = tmpst::getHeight(resolution, refresh);
+
+        active_width = atoi(resolution.substr(0, resolution.find('x')).c_str());
+        active_height = atoi(resolution.substr(resolution.find('x')+1).c_str());
+
+        if(valid()) setTestImage();
+    }
+
+    bool signalGenerator::valid(){ return width > 0 && height > 0 && active_width > 0 && active_height > 0; }
+    int signalGenerator::getWidth(){ return width; }
+    int signalGenerator::getHeight(){ return height; }
+
+    void signalGenerator::setRefreshError(double ppm, double ppm_per_second){
+        refresh_error = ppm;
+        drift = ppm_per_second;
+    }
+    void signalGenerator::setNoise(double deviation){ noise = deviation; }
+    void signalGenerator::setInterlaced(bool interlaced){ this->interlaced = interlaced; }
+    void signalGenerator::setSeed(unsigned int seed){ this->seed = seed; }
+
+    void signalGenerator::setImage(const Mat & screen){
+        Mat grey = screen;
+        if(screen.channels() == 3) cvtColor(screen, grey, COLOR_BGR2GRAY);
+        resize(grey, image, Size(active_width, active_height), 0, 0, INTER_AREA);
+    }
+
+    /**
+     * Something easy to recognise after reconstruction: a gradient, a checkerboard, a frame and text
+     */
+    void signalGenerator::setTestImage(){
+        image = Mat::zeros(active_height, active_width, CV_8U);
+
+        for(int y=0; y<active_height; y++){
+            for(int x=0; x<active_width; x++){
+                if(y < active_height/3)     image.at<uchar>(y,x) = 255*x/active_width;
+                else if(x > active_width/2) image.at<uchar>(y,x) = (((x/32)+(y/32))%2) ? 255 : 0;
+            }
+        }
+
+        rectangle(image, Point(0,0), Point(active_width-1, active_height-1), Scalar(255), 4);
+        putText(image, "TEMPEST", Point(active_width/16, active_height*2/3), FONT_HERSHEY_SIMPLEX,
+                active_width/400.0, Scalar(255), max(active_width/200, 1));
+    }
+
+    /**
+     * Renders samples first up to first+count (sample numbers from the start of the capture)
+     */
+    void signalGenerator::render(complex<short> * samples, long first, long count){
+        double real_refresh = refresh*(1+refresh_error*1e-6);
+        double refresh_drift = refresh*drift*1e-6;                  // Hz per second
+
+        const long block_size = 1<<14;
+        long block_count = (count+block_size-1)/block_size;
+
+        // every block has its own noise so the result does not depend on the thread count
+#pragma omp parallel for schedule(static)
+        for(long block=0; block<block_count; block++){
+            mt19937 random(seed ^ (unsigned int)((first/block_size+block)*2654435761u));
+            normal_distribution<float> distribution(0, noise);
+
+            long end = min((block+1)*block_size, count);
+            for(long k=block*block_size; k<end; k++){
+                double time = (first+k)/sample_rate;
+                double frames = real_refresh*time + 0.5*refresh_drift*time*time;
+                double phase = frames-floor(frames);
+
+                int row = int(phase*height);
+                int column = int((phase*height-row)*width);
+
+                // an interlaced frame draws the even lines then the odd lines
+                int line = row;
+                if(interlaced) line = (row < height/2) ? 2*row : 2*(row-height/2)+1;
+
+                float brightness = 0;
+                if(line < active_height && column < active_width) brightness = image.at<uchar>(line, column);
+
+                float I_sample = 300 + 8*brightness + distribution(random);
+                float Q_sample = distribution(random);
+
+                samples[k] = complex<short>(short(max(min(I_sample, 32767.0f), -32768.0f)),
+                                            short(max(min(Q_sample, 32767.0f), -32768.0f)));
+            }
+        }
+    }
+
+    /**
+     * Writes the given amount of frames as raw sc16 samples (what loadDataFile reads)
+     */
+    bool signalGenerator::writeFile(string filename, double frames){
+        if(!valid()){
+            cerr << "No timing known for this resolution and refresh rate" << endl;
+            return false;
+        }
+
+        ofstream output(filename, ios::binary);
+        if(!output){
+            cerr << "Could not open output file: " << filename << endl;
+            return false;
+        }
+
+        long total = (long) ceil(frames*sample_rate/refresh);
+        const long chunk = 1<<20;
+        vector<complex<short>> samples(chunk);
+
+        for(long written=0; written<total; written+=chunk){
+            long count = min(chunk, total-written);
+            render(&samples.front(), written, count);
+            output.write((const char *) &samples.front(), count*sizeof(complex<short>));
+        }
+
+        if(!output){
+            cerr << "Could not write all samples to " << filename << endl;
+            return false;
+        }
+        return true;
+    }
+
+}
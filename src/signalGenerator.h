@@ -0,0 +1,51 @@
+#ifndef _SIGNALGENERATOR_H_
+#define _SIGNALGENERATOR_H_
+#include <opencv2/core/utility.hpp>
+#include <string>
+#include <complex>
+
+namespace tmpst{
+
+    /**
+     * Renders an image as the sc16 IQ samples a receiver would pick up from a monitor.
+     * The timing (total width and height, blanking included) comes from resMap, the pixel
+     * brightness sets the sample magnitude. The monitor refresh can be off by an error and
+     * drift over time. Interlaced frames (refresh is the frame rate, half the field rate)
+     * draw the even lines then the odd lines, the way reconInterlace expects them.
+     */
+    class signalGenerator{
+    private:
+        int active_width, active_height;    // visible resolution
+        int width, height;                  // total resolution (resMap timing)
+        double refresh;
+        double sample_rate;
+
+        double refresh_error = 0;           // parts per million the real refresh is off
+        double drift = 0;                   // change of the refresh error, ppm per second
+        double noise = 50;                  // standard deviation of the noise (sample units)
+        bool interlaced = false;
+        unsigned int seed = 1234;
+
+        cv::Mat image;                      // what is on screen, active_height x active_width CV_8U
+
+    public:
+        signalGenerator(std::string resolution, double refresh, double sample_rate);
+
+        bool valid();
+        int getWidth();
+        int getHeight();
+
+        void setRefreshError(double ppm, double ppm_per_second);
+        void setNoise(double deviation);
+        void setInterlaced(bool interlaced);
+        void setSeed(unsigned int seed);
+
+        void setImage(const cv::Mat & screen);
+        void setTestImage();
+
+        void render(std::complex<short> * samples, long first, long count);
+        bool writeFile(std::string filename, double frames);
+    };
+
+}
+#endif
@@ -1,7 +1,19 @@
 #include "tempest.h"
 #include <uhd/usrp/multi_usrp.hpp>
+#include <uhd/utils/thread_priority.hpp>
 #include "frameStream.h"
+#include "kernels.h"
+#include "boundedQueue.h"
+#include "trace.h"
+#include "imageWriter.h"
+#include "bandCache.h"
+#include "resolutionDetector.h"
+#include "channelizer.h"
 #include <thread>
+#include <future>
+#include <boost/format.hpp>
+#include <chrono>
+#include <mutex>
 #include <omp.h>
 #include <unordered_map>
 #include <opencv2/core/utility.hpp>
@@ -14,6 +26,8 @@ using namespace cv;
 
 namespace tmpst{
 
+    atomic<bool> tempest::live_running(false);
+
     tempest::tempest(   uhd::usrp::multi_usrp::sptr usrp,
                         string name,
                         int width, int height, double refresh,
@@ -77,20 +91,67 @@ namespace tmpst{
         bandwidth_multiples = 1;
     }
 
+    void tempest::setCorrelationMode(correlationMode mode){ correlation_mode = mode; }
+    void tempest::setFractional(bool fractional){ this->fractional = fractional; }
+    void tempest::setAveraging(averageMode mode, double trim, double reject){
+        average_mode = mode;
+        trim_fraction = trim;
+        reject_threshold = reject;
+    }
+    void tempest::setStreaming(int calibration_frames){ this->calibration_frames = calibration_frames; }
+    void tempest::setSource(shared_ptr<sampleSource> source){ sources.assign(1, source); }
+    void tempest::setSources(vector<shared_ptr<sampleSource>> sources){ this->sources = sources; }
+    void tempest::setMemoryBudget(size_t bytes){ sample_memory.setLimit(bytes); }
+    void tempest::setRegistration(registrationMode mode){ registration = mode; }
+    void tempest::setWideband(double rate){ wideband_rate = rate; }
+    void tempest::setSampleBuffer(Mat * buffer){ sample_buffer = buffer; }
+
     /**
      * Initializes center frequencies for all bands and adds the to the band waggon :D
      */
     void tempest::initializeBands(){
+        double spacing = sample_rate*bandwidth_overlap;
+
+        if(wideband_rate > 0 && !from_file){
+            // the bands are channels of one capture, the channel spacing and rate have to divide its rate
+            wide_channels = max(1, int(lround(wideband_rate/spacing)));
+            wide_decimation = max(1, int(lround(wideband_rate/sample_rate)));
+
+            if(fabs(wideband_rate/wide_channels-spacing) > 0.001*spacing || fabs(wideband_rate/wide_decimation-sample_rate) > 0.001*sample_rate)
+                cout << "Wideband: bands are " << wideband_rate/wide_decimation/1e6 << "MHz wide every "
+                     << wideband_rate/wide_channels/1e6 << "MHz, the closest the capture rate divides into" << endl;
+            sample_rate = wideband_rate/wide_decimation;
+            spacing = wideband_rate/wide_channels;
+
+            // a channel c off the centre only stays clear of the capture's edges while
+            // |c|*spacing + sample_rate/2 <= wideband_rate/2, ie |c| <= M(D-1)/(2D)
+            int usable = 2*((wide_channels*(wide_decimation-1))/(2*wide_decimation))+1;
+            if(bandwidth_multiples > usable){
+                cout << "Wideband: a " << wideband_rate/1e6 << "MHz capture only holds " << usable
+                     << " bands clear of its edges, dropping the bands at";
+                for(int i=usable; i<bandwidth_multiples; i++) cout << " " << (base_center_freq+i*spacing)/1e6 << "MHz";
+                cout << endl;
+                bandwidth_multiples = usable;
+            }
+            wide_center = base_center_freq + ((bandwidth_multiples-1)/2)*spacing; // band 0 stays on the base
+            if(verbose) cout << "Wideband capture at " << wide_center << " split into " << wide_channels
+                             << " channels, decimated by " << wide_decimation << endl;
+        }
+
         bands = vector<tmpst::frameStream>(bandwidth_multiples);
 
         if(verbose) cout << endl << "Adding new recordings with base band: " << endl;
         for(int i=0; i<bandwidth_multiples; i++){
-            double band_center = base_center_freq+i*sample_rate*bandwidth_overlap;
+            double band_center = base_center_freq+i*spacing;
             if(verbose) cout << "\t" << band_center << endl;
 
             tmpst::frameStream newFrame(width, height, refresh,
                                         band_center,
                                         frame_av_num, sample_rate, inverted, interlaced, verbose, name);
+            newFrame.setCorrelationMode(correlation_mode);
+            newFrame.setFractional(fractional);
+            newFrame.setAveraging(average_mode, trim_fraction, reject_threshold);
+            if(calibration_frames > 0) newFrame.setStreaming(calibration_frames, max_shift);
 
             bands[i] = newFrame;
         }
@@ -100,53 +161,460 @@ namespace tmpst{
     /**
      * After data has been read the bands can now process their raw data into their respective frames
      */
-    void tempest::processBands(){
+    bool tempest::processBands(){
 
         if(from_file){ // there can only be one band
             // ====================== READING FROM FILE ==============================
-            bands[0].loadDataFile(input_file, frame_ignore);
+            size_t band_bytes = bands[0].sampleBytes(); // createFinalFrame changes what sampleBytes gives
+            sample_memory.reserve(band_bytes, false);
+            if(sample_buffer) bands[0].useSampleBuffer(*sample_buffer);
+            if(!bands[0].loadDataFile(input_file, frame_ignore)){
+                sample_memory.release(band_bytes);
+                return false;
+            }
             int shifting = bands[0].processSamples(max_shift).first;
             cout << "tmpst: " << shifting << endl;
             bands[0].createFinalFrame(shifting);
             bands[0].saveImage("final_image-"+to_string(bands[0].getFrequency()));
+            sample_memory.release(band_bytes);
+
+            saveCache();
 
         }else{
             // ===================== READING FROM RECIEVER ============================
+            // The receiver captures the bands back to back while the workers process the captured ones.
+            // At most two rounds of captured bands wait for a worker (double buffered), then the receiver waits.
+            // With several sources a round is one band per source, and there is a worker per source.
 
+            // The bands wait on each other for the best shift, so with a memory budget that cannot hold
+            // every band the processed ones are spilled to disk and the receiver waits for room.
             unordered_map<int, unsigned int> best_shifts; // storing the best shifts so all shifts are consistant
-#pragma omp parallel for
-            for(int i=0; i<bands.size(); i++){
-
-#pragma omp critical
-                //======== Loading file ==========
-                {
-                if(verbose) cout << endl << "Loading in data for band " << i << endl;
-                bands[i].loadDataRx(usrp, offset, channel, frame_ignore);
-                if(verbose) cout << "Reading complete" << endl;
+            mutex shift_lock;
+
+            size_t band_bytes = bands[0].sampleBytes();
+            bool spilling = sample_memory.getLimit() > 0 && calibration_frames == 0
+                            && band_bytes*bands.size() > sample_memory.getLimit();
+            vector<char> held(bands.size(), 0);
+            atomic<int> spilled(0), unspilled(0);
+
+            int receivers = max(size_t(1), sources.size()); // bands captured at the same time
+            boundedQueue<int> captured(2*receivers);
+            double capture_time = 0;
+            atomic<long> process_time_us(0);
+            auto sweep_start = chrono::steady_clock::now();
+            loaded.assign(bands.size(), 0);
+
+            thread receiver([&](){
+                uhd::set_thread_priority_safe();
+
+                auto start = chrono::steady_clock::now();
+
+                if(wideband_rate > 0){
+                    captureWideband(captured, spilling);
+                }else if(!sources.empty()){
+                    captureScheduled(captured, spilling);
+                }else{
+                    for(int i=0; i<bands.size(); i++){
+                        //======== Loading file ==========
+                        sample_memory.reserve(band_bytes, spilling);
+                        if(verbose) cout << endl << "Loading in data for band " << i << endl;
+                        loaded[i] = bands[i].loadDataRx(usrp, offset, channel, frame_ignore);
+                        if(!loaded[i]) cerr << "Band " << i << " was not received completely" << endl;
+                        else if(verbose) cout << "Reading complete" << endl;
+
+                        captured.push(i);
+                    }
                 }
 
-                if(verbose) cout << endl << "Processing data." << endl;
+                capture_time = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+                captured.close();
+            });
+
+            // the workers share the processing threads instead of each starting a team of every core
+            int worker_count = max(2, receivers);
+            int worker_threads = max(1, omp_get_max_threads()/worker_count);
+
+            vector<thread> workers;
+            for(int w=0; w<worker_count; w++){
+                workers.push_back(thread([&](){
+                    omp_set_num_threads(worker_threads);
+                    int i;
+                    while(captured.pop(i)){
+                        if(verbose) cout << endl << "Processing data." << endl;
+                        auto start = chrono::steady_clock::now();
+
+                        //======== Processing file ==========
+                        pair<int, unsigned int> shift = bands[i].processSamples(max_shift);
+                        if(verbose) cout << "Band " << i << " shifted by " << shift.first << " percentage of shifted frames " << double(shift.second) << endl;
+
+                        process_time_us += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now()-start).count();
+
+                        //======== Making room ==========
+                        held[i] = 1;
+                        if(spilling){
+                            if(bands[i].spillSamples()) spilled++;
+                            else unspilled++; // stays in memory, but cant be waited on
+                            sample_memory.release(band_bytes);
+                            held[i] = 0;
+                        }
+
+                        //======== Finding best shift ==========
+                        lock_guard<mutex> guard(shift_lock);
+                        best_shifts[shift.first]++;
+                    }
+                }));
+            }
 
-                //======== Processing file ==========
-                pair<int, unsigned int> shift = bands[i].processSamples(max_shift);
-                if(verbose) cout << "Band " << i << " shifted by " << shift.first << " percentage of shifted frames " << double(shift.second) << endl;
+            receiver.join();
+            for(thread & worker : workers) worker.join();
 
+            if(verbose) cout << endl << "Sweep took " << chrono::duration<double>(chrono::steady_clock::now()-sweep_start).count()
+                             << "s (receiver busy " << capture_time << "s, processing " << process_time_us/1e6 << "s)" << endl;
 
-                //======== Finding best shift ==========
-#pragma omp critical
-                {
-                best_shifts[shift.first]++;
+            //======== final processing file ==========
+            // bands still in memory first, then the spilled ones are read back one budget at a time
+            int shift_amount = mapMode(best_shifts).first;
+            for(int pass=1; pass>=0; pass--){
+                for(int i=0; i<bands.size(); i++){
+                    if(held[i] != pass) continue;
+
+                    if(!held[i]) sample_memory.reserve(band_bytes, spilling);
+                    bands[i].createFinalFrame(shift_amount);
+                    bands[i].saveImage("final_image-"+to_string(bands[i].getFrequency()));
+                    sample_memory.release(band_bytes);
                 }
             }
 
-            //======== final processing file ==========
-            int shift_amount = mapMode(best_shifts).first;
-            for(int i=0; i<bands.size(); i++){
-                bands[i].createFinalFrame(shift_amount);
-                bands[i].saveImage("final_image-"+to_string(bands[i].getFrequency()));
+            if(sample_memory.getLimit() > 0 || verbose){
+                cout << "Sample memory peak: " << sample_memory.peakUse()/1048576.0 << "MB";
+                if(sample_memory.getLimit() > 0) cout << " of a " << sample_memory.getLimit()/1048576.0 << "MB budget";
+                cout << " (at most " << sample_memory.peakHolders() << " of " << bands.size() << " bands held, "
+                     << spilled << " spilled to disk)" << endl;
+                if(unspilled > 0) cout << unspilled << " bands could not be spilled and were held outside the budget" << endl;
+                if(sample_memory.getLimit() > 0 && calibration_frames > 0 && sample_memory.peakUse() > sample_memory.getLimit())
+                    cout << "Streaming bands are not spilled, the budget could not be kept" << endl;
+            }
+
+            saveCache();
+
+            // a band that came in short is still drawn, but the sweep did not work out
+            int failed = count(loaded.begin(), loaded.end(), 0);
+            if(failed > 0){
+                cerr << failed << " of " << bands.size() << " bands were not received completely" << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Captures (or reads) seconds of the base band and ranks the resMap entries that fit it best.
+     * Width, height and refresh given by the user are not used.
+     */
+    void tempest::detectResolution(double seconds, int top){
+        // one "frame" plus the extra frame is the whole capture, so the normal loaders fill it
+        tmpst::frameStream capture(1, 1, 2.0/seconds, base_center_freq, 1, sample_rate, inverted, false, verbose, name);
+
+        bool loaded;
+        if(from_file) loaded = capture.loadDataFile(input_file, 0);
+        else if(!sources.empty()){
+            sources[0]->tune(base_center_freq, offset, -1);
+            sources[0]->stream(lround(sample_rate*seconds), -1);
+            loaded = capture.loadDataSource(*sources[0], 0);
+        }
+        else loaded = capture.loadDataRx(usrp, offset, channel, 0);
+        if(!loaded) return;
+
+        auto start = chrono::steady_clock::now();
+        resolutionDetector detector(capture.getSamples(), sample_rate);
+        vector<resolutionCandidate> candidates = detector.rank(top);
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+
+        cout << endl << "Best matching resolutions (" << elapsed << "s):" << endl;
+        for(resolutionCandidate & candidate : candidates){
+            cout << boost::format("  %-16s %4dx%-4d total  %9.4fHz  score %.3f (frame %.3f, line %.3f)")
+                    % candidate.name % candidate.width % candidate.height % candidate.refresh
+                    % candidate.score % candidate.frame_score % candidate.line_score << endl;
+        }
+        if(candidates.empty()) cout << "  none, the capture is too short for even one frame" << endl;
+    }
+
+    /**
+     * How well image lines up with reference (both the same size) after image is shifted by offset,
+     * wrapping around the same way shiftImage does. reference has to be zero mean.
+     */
+    static double shiftedScore(const Mat & reference, const Mat & image, Point offset){
+        int rows = reference.rows, cols = reference.cols;
+        int first_column = ((-offset.x)%cols + cols)%cols;
+        double score = 0;
+
+        for(int y=0; y<rows; y++){
+            const float * wanted = reference.ptr<float>(y);
+            const float * moved = image.ptr<float>((((y-offset.y)%rows) + rows)%rows);
+
+            int column = first_column;
+            for(int x=0; x<cols; x++){
+                score += wanted[x]*moved[column];
+                if(++column == cols) column = 0;
+            }
+        }
+        return score;
+    }
+
+    /**
+     * Offsets (for shiftImage) that line every band up with band 0.
+     * Phase correlation of the mini images gives each offset (and how sure it is, 0-1), which is then
+     * refined on the full images within the size of one mini image pixel. Every band is done at once.
+     */
+    vector<Point> tempest::registerBands(vector<double> & responses){
+        vector<Point> offsets(bands.size(), Point(0,0));
+        responses.assign(bands.size(), 1.0);
+
+        Mat main_mini, main_full;
+        bands[0].getMiniImage().convertTo(main_mini, CV_64F);
+        bands[0].getFinalImage().convertTo(main_full, CV_32F);
+        main_full = main_full - mean(main_full)[0];
+
+        double scale_x = double(width)/main_mini.cols, scale_y = double(height)/main_mini.rows;
+        int radius = int(ceil(max(scale_x, scale_y)));
+
+#pragma omp parallel for schedule(dynamic)
+        for(int i=1; i<bands.size(); i++){
+            TRACE_SCOPE("registration", bands[i].getFrequency());
+
+            Mat next_mini, next_full;
+            bands[i].getMiniImage().convertTo(next_mini, CV_64F);
+            bands[i].getFinalImage().convertTo(next_full, CV_32F);
+            if(next_mini.size() != main_mini.size() || next_full.size() != main_full.size()) continue;
+
+            // next is main moved by shift, so it has to be moved back
+            double response = 0;
+            Point2d shift = phaseCorrelate(main_mini, next_mini, Mat(), &response);
+            Point estimate(lround(-shift.x*scale_x), lround(-shift.y*scale_y));
+
+            Point best = estimate;
+            double best_score = shiftedScore(main_full, next_full, estimate);
+            for(int dy=-radius; dy<=radius; dy++){
+                for(int dx=-radius; dx<=radius; dx++){
+                    Point offset(estimate.x+dx, estimate.y+dy);
+                    double score = shiftedScore(main_full, next_full, offset);
+                    if(score > best_score){
+                        best_score = score;
+                        best = offset;
+                    }
+                }
+            }
+
+            offsets[i] = best;
+            responses[i] = response;
+        }
+
+        return offsets;
+    }
+
+    /**
+     * Keeps the averaged frame of every band, so they can be drawn and combined again without
+     * capturing or correlating (--from_cache)
+     */
+    void tempest::saveCache(){
+        vector<cachedBand> cached;
+        for(frameStream & band : bands){
+            cachedBand entry;
+            entry.frequency = band.getFrequency();
+            entry.shift = band.getShift();
+            entry.frame = band.getAverageFrame();
+            cached.push_back(entry);
+        }
+
+        cacheInfo info;
+        info.width = width;
+        info.height = height;
+        info.refresh = refresh;
+        info.sample_rate = sample_rate;
+        info.frame_average = frame_av_num;
+
+        if(writeBandCache(name+"bands.cache", info, cached) && verbose)
+            cout << "Averaged frames cached in " << name << "bands.cache" << endl;
+    }
+
+    /**
+     * Makes the bands from a band cache instead of samples.
+     * Only drawing, centering (and then combineBands) is left to do, so inverted and interlaced
+     * can be changed without capturing again.
+     */
+    bool tempest::processCache(string cache_file){
+        cacheInfo info;
+        vector<cachedBand> cached;
+        if(!readBandCache(cache_file, info, cached) || cached.empty()) return false;
+
+        width = info.width;
+        height = info.height;
+        refresh = info.refresh;
+        sample_rate = info.sample_rate;
+        frame_av_num = info.frame_average;
+
+        bands.clear();
+        for(cachedBand & entry : cached){
+            if(verbose) cout << endl << "Band " << entry.frequency << " from cache, shifted by " << entry.shift << endl;
+
+            tmpst::frameStream band(width, height, refresh,
+                                    entry.frequency,
+                                    frame_av_num, sample_rate, inverted, interlaced, verbose, name);
+            band.loadAverage(entry.frame, entry.shift);
+            band.saveImage("final_image-"+to_string(band.getFrequency()));
+
+            bands.push_back(band);
+        }
+
+        return true;
+    }
+
+    int tempest::getShift(){ return bands.empty() ? 0 : bands[0].getShift(); }
+
+    /**
+     * Where the final image of a band was written (without the extension)
+     */
+    string tempest::finalImage(int band){ return name+"final_image-"+to_string(bands[band].getFrequency()); }
+
+    /**
+     * Captures every band through the sources (one streamer each) with timed commands.
+     * Each round of bands gets a slot of whole frames, one band per source: the retunes are commanded
+     * settlingTime before the slot, and the bursts all start exactly on the slot. The sources share a
+     * time base (channels of one device, or devices synced to the same pps), so N bands take about
+     * N/sources slots. Since the slots are on a grid of frame periods every band starts at the same
+     * frame phase, so combineBands only has to search a small area.
+     * Waiting on the memory budget only costs whole slots, the phase is kept.
+     */
+    void tempest::captureScheduled(boundedQueue<int> & captured, bool wait_memory){
+        double frame_period = 1.0/refresh;
+        long burst_samples = lround(sample_rate/refresh)*(frame_av_num+frame_ignore+1); // same as frameStream reads
+        double burst_length = burst_samples/sample_rate;
+        double settle = 0;
+        for(auto & source : sources) settle = max(settle, source->settlingTime());
+        double lead = 0.05; // time to get the commands to the device
+
+        double slot = ceil((settle+burst_length)/frame_period)*frame_period;
+        double first = ceil((sources[0]->getTime()+settle+lead)/frame_period)*frame_period;
+        int rounds = (bands.size()+sources.size()-1)/sources.size();
+
+        if(verbose) cout << "Sweep slots of " << slot*1000 << "ms, settling " << settle*1000 << "ms, "
+                         << sources.size() << " bands per slot" << endl;
+
+        double start = first;
+        for(int round=0; round<rounds; round++){
+            int first_band = round*sources.size();
+            int last_band = min(int(bands.size()), first_band+int(sources.size()));
+
+            // the bands of a round are captured together, so they wait for room together
+            sample_memory.reserveGroup(bands[first_band].sampleBytes(), last_band-first_band, wait_memory);
+
+            // if the host fell behind move on by whole frames so the phase stays the same
+            double earliest = sources[0]->getTime()+settle+lead;
+            if(start < earliest) start += ceil((earliest-start)/frame_period)*frame_period;
+
+            for(int i=first_band; i<last_band; i++){
+                sampleSource & source = *sources[i-first_band];
+                if(verbose) cout << endl << "Loading in data for band " << i << " on source " << i-first_band << " at " << start << "s" << endl;
+                source.tune(bands[i].getFrequency(), offset, start-settle);
+                source.stream(burst_samples, start);
+            }
+
+            // every source is read on its own thread, the bursts run at the same time
+            vector<future<bool>> receiving;
+            for(int i=first_band+1; i<last_band; i++){
+                receiving.push_back(async(launch::async, [this, i, first_band](){
+                    uhd::set_thread_priority_safe();
+                    return bands[i].loadDataSource(*sources[i-first_band], frame_ignore);
+                }));
+            }
+            bool complete = bands[first_band].loadDataSource(*sources[0], frame_ignore);
+
+            for(int i=first_band; i<last_band; i++){
+                if(i > first_band) complete = receiving[i-first_band-1].get();
+                loaded[i] = complete;
+                if(!complete) cerr << "Band " << i << " was not received completely" << endl;
+
+                captured.push(i);
+            }
+            start += slot;
+        }
+
+        phase_locked = true;
+    }
+
+    /**
+     * Captures every band at once: one burst at wideband_rate around wide_center is split into
+     * the bands by a polyphase channelizer, so there is one retune (and settling) instead of one per band.
+     * Band i is channel i-(bands-1)/2 of the capture. The capture and the channels split from it are
+     * counted against the memory budget until the capture is freed. After that only the loaded bands count,
+     * a channel waiting for its band is already in memory and cannot wait for room.
+     */
+    void tempest::captureWideband(boundedQueue<int> & captured, bool wait_memory){
+        channelizer bank(wide_channels, wide_decimation);
+        long band_samples = lround(sample_rate/refresh)*(frame_av_num+frame_ignore+1); // same as frameStream reads
+        size_t first_output = (bank.historyLength()+wide_decimation-1)/wide_decimation;
+        size_t wide_samples = (band_samples+first_output)*wide_decimation;
+
+        shared_ptr<sampleSource> source = (sources.empty()) ? NULL : sources[0];
+        if(!source){
+            // the lo transient would land in every channel, so it gets measured
+            shared_ptr<uhdSource> receiver = make_shared<uhdSource>(usrp, channel, 0.01); // kept without a lo_locked sensor
+            receiver->measureSettling(wide_center, offset);
+            source = receiver;
+        }
+        double settle = source->settlingTime();
+
+        // the channels come out while the capture is still held
+        size_t wide_bytes = (wide_samples + bands.size()*bank.outputLength(wide_samples))*sizeof(complex<short>);
+        sample_memory.reserve(wide_bytes, wait_memory);
+
+        vector<complex<short>> capture(wide_samples);
+        size_t received = 0;
+        {
+            TRACE_SCOPE("rx");
+            if(verbose) cout << endl << "Capturing " << wide_samples << " samples at " << wideband_rate/1e6 << "MHz" << endl;
+
+            source->tune(wide_center, offset, -1);
+            source->stream(wide_samples, (settle > 0) ? source->getTime()+settle+0.05 : -1);
+
+            uhd::rx_metadata_t meta_data;
+            while(received < wide_samples){
+                received += source->recv(&capture[received], wide_samples-received, meta_data, 3.0);
+                if(meta_data.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE){
+                    cerr << "Wideband capture stopped after " << received << " samples: " << meta_data.strerror() << endl;
+                    break;
+                }
             }
+            if(sources.empty()) source->stop();
+        }
+
+        vector<int> wanted(bands.size());
+        for(int i=0; i<bands.size(); i++) wanted[i] = i-(int(bands.size())-1)/2;
+
+        vector<vector<complex<short>>> channels;
+        bank.process(capture.data(), received, wanted, channels);
+        capture = vector<complex<short>>(); // only the channels from here
+        sample_memory.release(wide_bytes);
+
+        for(int i=0; i<bands.size(); i++){
+            sample_memory.reserve(bands[i].sampleBytes(), wait_memory);
 
+            bool complete = channels[i].size() >= size_t(band_samples); // a short buffer would be played over again
+            if(complete){
+                bufferSource channel_source(move(channels[i]), sample_rate);
+                channel_source.stream(band_samples, -1);
+                complete = bands[i].loadDataSource(channel_source, frame_ignore);
+            }
+            loaded[i] = complete;
+            if(!complete){
+                cerr << "Band " << i << " was not received completely" << endl;
+                channels[i] = vector<complex<short>>();
+            }
+
+            captured.push(i);
         }
+
+        phase_locked = true;
     }
 
     /**
@@ -156,28 +624,49 @@ namespace tmpst{
     void tempest::combineBands(){
         Mat main_band = bands[0].getFinalImage();
         
-        //max shifts possible
-        int xboard = 600, yboard = 200;
+        //max shifts possible (much less when the bands started at the same frame phase)
+        int xboard = (phase_locked) ? 100 : 600, yboard = (phase_locked) ? 40 : 200;
 
-        Mat big_band = Mat::zeros(height+yboard, width+xboard, CV_8U);
-        randn(big_band, Scalar(5), Scalar(20));
+        Mat big_band;
+        vector<Point> offsets;
+        vector<double> responses;
 
-        main_band.copyTo(big_band(Rect((big_band.cols - main_band.cols)/2, (big_band.rows - main_band.rows)/2, main_band.cols, main_band.rows)));
+        if(registration == REGISTRATION_PHASE){
+            offsets = registerBands(responses);
+        }else{
+            big_band = Mat::zeros(height+yboard, width+xboard, CV_8U);
+            randn(big_band, Scalar(5), Scalar(20));
+
+            main_band.copyTo(big_band(Rect((big_band.cols - main_band.cols)/2, (big_band.rows - main_band.rows)/2, main_band.cols, main_band.rows)));
+        }
 
         bands[0].saveImage("shifted_image-"+to_string(bands[0].getFrequency()));
 
         for(int i=1; i<bands.size(); i++){
             Mat next_band = bands[i].getFinalImage();
+
+            if(registration == REGISTRATION_PHASE){
+                cout << "Band " << bands[i].getFrequency() << " offset (" << offsets[i].x << ", " << offsets[i].y
+                     << ") response " << responses[i] << endl;
+
+                shiftImage(next_band.clone(), next_band, offsets[i].x, offsets[i].y);
+                bands[i].saveImage("shifted_image-"+to_string(bands[i].getFrequency()));
+                continue;
+            }
+
             int result_cols = big_band.cols - next_band.cols + 1;
             int result_rows = big_band.rows - next_band.rows + 1;
 
             Mat result = Mat::zeros(result_rows, result_cols, CV_32F);
 
             // match then normalize
-            matchTemplate( big_band, next_band, result, CV_TM_CCOEFF_NORMED);
+            {
+                TRACE_SCOPE("template match", bands[i].getFrequency());
+                matchTemplate( big_band, next_band, result, CV_TM_CCOEFF_NORMED);
 
-            // normalize
-            normalize(result, result, 0, 255, NORM_MINMAX, -1, Mat() );
+                // normalize
+                normalize(result, result, 0, 255, NORM_MINMAX, -1, Mat() );
+            }
 
             double minVal, maxVal;
             Point minLoc, maxLoc;
@@ -193,10 +682,38 @@ namespace tmpst{
 
         }
 
-        // combine bands (weighted average of frames, ie first band is 50% second 25% third 12.5% etc)
-        Mat combine_image = bands[bands.size()-1].getFinalImage().clone(); //Mat::zeros(height,width, CV_8U);
-        for(int i=bands.size()-2; i>=0; i--){
-            combine_image = (combine_image+bands[i].getFinalImage())/2;
+        // combine bands (average weighted by how clean each band came out, in floats)
+        vector<double> weights(bands.size());
+        double weight_total = 0;
+        for(int i=0; i<bands.size(); i++){
+            weights[i] = imageQuality(bands[i].getFinalImage());
+            weight_total += weights[i];
+        }
+        if(weight_total <= 0){ // nothing stands out of the noise, every band counts the same
+            fill(weights.begin(), weights.end(), 1.0);
+            weight_total = bands.size();
+        }
+
+        for(int i=0; i<bands.size(); i++){
+            weights[i] /= weight_total;
+            if(verbose) cout << "Band " << bands[i].getFrequency() << " weight " << weights[i] << endl;
+        }
+
+        Mat combine_image = Mat::zeros(height, width, CV_32F);
+        {
+            TRACE_SCOPE("fusion");
+            vector<Mat> finals(bands.size());
+            for(int i=0; i<bands.size(); i++) finals[i] = bands[i].getFinalImage();
+
+#pragma omp parallel for
+            for(int y=0; y<height; y++){
+                float * out = combine_image.ptr<float>(y);
+                for(int i=0; i<finals.size(); i++){
+                    const uchar * in = finals[i].ptr<uchar>(y);
+                    float weight = float(weights[i]);
+                    for(int x=0; x<width; x++) out[x] += weight*in[x];
+                }
+            }
         }
 
         //normalize the result
@@ -204,10 +721,145 @@ namespace tmpst{
         normalize(combine_image, combine_image, 255, 0, NORM_MINMAX, CV_8UC1);
 
         //save final image
-        imwrite(name+"combined_bands.jpg", combine_image);
+        TRACE_SCOPE("write");
+        imageWriter::shared().write(name+"combined_bands", combine_image);
 
     }
 
 
 
+    // ===================================================================================
+    // ================================== LIVE MODE ======================================
+    // ===================================================================================
+
+    /**
+     * Streams from the receiver into the ring buffer until live mode is stopped.
+     * Overflows are counted (and where they happened remembered) instead of stopping the stream.
+     */
+    void tempest::receiveContinuous(ringBuffer<unsigned short> & ring,
+                                    atomic<unsigned long> & overflows,
+                                    atomic<uint64_t> & last_overflow){
+        uhd::set_thread_priority_safe();
+
+        uhd::stream_args_t stream_arguments("sc16","sc16");
+        stream_arguments.channels = vector<size_t>(1, channel);
+        uhd::rx_streamer::sptr receiver_stream = usrp->get_rx_stream(stream_arguments);
+
+        uhd::rx_metadata_t meta_data;
+        vector<complex<short>> buffer(receiver_stream->get_max_num_samps());
+
+        uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS);
+        stream_cmd.stream_now   = true;
+        stream_cmd.time_spec    = uhd::time_spec_t();
+        receiver_stream->issue_stream_cmd(stream_cmd);
+
+        while(live_running){
+            size_t num_rx_samps = receiver_stream->recv(&buffer.front(), buffer.size(), meta_data, 1.0, false);
+
+            // receiver error handeling
+            if(meta_data.error_code == uhd::rx_metadata_t::ERROR_CODE_OVERFLOW){
+                overflows++;
+                last_overflow = ring.total();
+                continue;
+            }else if(meta_data.error_code == uhd::rx_metadata_t::ERROR_CODE_TIMEOUT){
+                cout << "Time out while receiving!" << endl;
+                continue;
+            }else if(meta_data.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE){
+                cerr << "Unknown receiver error: " << meta_data.strerror() << endl;
+                continue;
+            }
+
+            // magnitudes go straight into the ring (in two parts if it wraps)
+            size_t done = 0;
+            while(done < num_rx_samps){
+                size_t count = num_rx_samps-done;
+                unsigned short * span = ring.writeSpan(count);
+                kernels::magnitude((const short *) &buffer[done], span, count);
+                ring.commit(count);
+                done += count;
+            }
+        }
+
+        // stop streaming
+        stream_cmd.stream_mode = uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS;
+        receiver_stream->issue_stream_cmd(stream_cmd);
+    }
+
+    /**
+     * Continuous monitoring of the base band.
+     * A receiver thread streams into a ring buffer while this thread reconstructs the newest
+     * frame_av_num frames image_rate times a second (as fast as it can if that is too often).
+     * Stops after image_count images, or never if image_count is 0 (until stopLive).
+     */
+    void tempest::processLive(double image_rate, int image_count){
+        if(from_file || !usrp){
+            cerr << "Live mode needs a usrp, not an input file or a simulated receiver" << endl;
+            return;
+        }
+
+        long pixels_per_image = round(sample_rate/refresh);
+        long window = pixels_per_image*(frame_av_num+1); // +1 for extra frame
+
+        // room for the window while the receiver keeps writing
+        ringBuffer<unsigned short> ring(4*window);
+        atomic<unsigned long> overflows(0);
+        atomic<uint64_t> last_overflow(0);
+
+        if(verbose) cout << "Live scanning frequency: " << base_center_freq/1000000 << "MHz" << endl;
+        uhd::tune_request_t tune_request(base_center_freq, offset);
+        usrp->set_rx_freq(tune_request, channel);
+
+        live_running = true;
+        thread receiver(&tempest::receiveContinuous, this, ref(ring), ref(overflows), ref(last_overflow));
+
+        auto period = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0/image_rate));
+        auto next_image = chrono::steady_clock::now() + period;
+        int images = 0, skipped = 0;
+
+        while(live_running && (image_count==0 || images<image_count)){
+            this_thread::sleep_until(next_image);
+            next_image += period;
+            if(next_image < chrono::steady_clock::now()) next_image = chrono::steady_clock::now() + period; // behind, dont try catch up
+
+            if(ring.total() < uint64_t(window)) continue; // still filling
+
+            tmpst::frameStream band(width, height, refresh,
+                                    base_center_freq,
+                                    frame_av_num, sample_rate, inverted, interlaced, verbose, name);
+            band.setCorrelationMode(correlation_mode);
+            band.setFractional(fractional);
+            band.setAveraging(average_mode, trim_fraction, reject_threshold);
+
+            uint64_t window_end;
+            if(!band.loadDataRing(ring, window_end)){
+                cout << "Receiver overwrote the window while copying, skipping image" << endl;
+                skipped++;
+                continue;
+            }
+            if(last_overflow > window_end-window){
+                if(verbose) cout << "Window has a receiver overflow in it, skipping image" << endl;
+                skipped++;
+                continue;
+            }
+
+            int shifting = band.processSamples(max_shift).first;
+            band.createFinalFrame(shifting);
+            band.saveImage("live_image-"+to_string(images));
+
+            cout << "Live image " << images << " shift " << shifting << " overflows " << overflows << endl;
+            images++;
+        }
+
+        live_running = false;
+        receiver.join();
+
+        cout << "Live mode finished: " << images << " images, " << skipped << " skipped, "
+             << overflows << " receiver overflows" << endl;
+    }
+
+    /**
+     * Stops live mode (safe to call from a signal handler)
+     */
+    void tempest::stopLive(){ live_running = false; }
+
 }
@@ -2,11 +2,22 @@
 #define _TEMPEST_H_
 #include <uhd/usrp/multi_usrp.hpp>
 #include <vector>
+#include <atomic>
 #include "frameStream.h"
+#include "ringBuffer.h"
+#include "boundedQueue.h"
+#include "sampleSource.h"
+#include "memoryBudget.h"
+#include <memory>
 #include "extraMath.h"
 
 namespace tmpst{
+
+    enum registrationMode{REGISTRATION_TEMPLATE, REGISTRATION_PHASE};
+
     class tempest{
+        friend class benchmark;     // times the private stages one by one
+
     private:
         //user dependant
         std::string name;                       //name of everything to be outputted
@@ -21,6 +32,19 @@ namespace tmpst{
         size_t channel;
         int frame_ignore;
         int max_shift;                          // maximum amount the frames can shift to align
+        correlationMode correlation_mode = CORRELATION_FFT; // how the frames are aligned
+        bool fractional = false;                // measure the frame length to a fraction of a sample
+        averageMode average_mode = AVERAGE_MEAN;// how the frames are averaged, with trim_fraction and reject_threshold
+        double trim_fraction = 0.2, reject_threshold = 0;
+        int calibration_frames = 0;             // frames used to find the shift when streaming (0 is off)
+        std::vector<std::shared_ptr<sampleSource>> sources; // when set the sweep is scheduled with timed commands, one band per source at a time
+        bool phase_locked = false;              // bands were captured starting at the same frame phase
+        memoryBudget sample_memory;             // sample memory of the bands in flight (--mem_budget)
+        registrationMode registration = REGISTRATION_TEMPLATE; // how combineBands lines the bands up
+        double wideband_rate = 0;               // capture every band at once at this rate and channelize (0 retunes)
+        int wide_channels = 1, wide_decimation = 1; // channelizer layout (see initializeBands)
+        double wide_center = 0;                 // where the wideband capture is tuned
+        cv::Mat * sample_buffer = NULL;         // reused for the samples of a file (batch workers)
 
         bool verbose, inverted, interlaced;
 
@@ -32,7 +56,20 @@ namespace tmpst{
         double full_spectrum_size;
 
         std::vector<tmpst::frameStream> bands;
+        std::vector<char> loaded;               // band i was received completely (set by the capture paths)
+
+        static std::atomic<bool> live_running;  // cleared to stop live mode
+
+        void saveCache();
+
+        std::vector<cv::Point> registerBands(std::vector<double> & responses);
+
+        void captureScheduled(boundedQueue<int> & captured, bool wait_memory);
+        void captureWideband(boundedQueue<int> & captured, bool wait_memory);
 
+        void receiveContinuous(ringBuffer<unsigned short> & ring,
+                               std::atomic<unsigned long> & overflows,
+                               std::atomic<uint64_t> & last_overflow);
 
 
     public:
@@ -61,12 +98,34 @@ namespace tmpst{
                 bool verbose);
 
 
+        void setCorrelationMode(correlationMode mode);
+        void setFractional(bool fractional);
+        void setAveraging(averageMode mode, double trim, double reject);
+        void setStreaming(int calibration_frames);
+        void setSource(std::shared_ptr<sampleSource> source);
+        void setSources(std::vector<std::shared_ptr<sampleSource>> sources);
+        void setMemoryBudget(size_t bytes);
+        void setRegistration(registrationMode mode);
+        void setWideband(double rate);
+        void setSampleBuffer(cv::Mat * buffer);
+
         void initializeBands();
 
-        void processBands();
+        bool processBands();
 
         void combineBands();
 
+        bool processCache(std::string cache_file);
+
+        int getShift();
+        std::string finalImage(int band);
+
+        void detectResolution(double seconds, int top);
+
+        void processLive(double image_rate, int image_count);
+
+        static void stopLive();
+
     };
 }
 #endif
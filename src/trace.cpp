@@ -0,0 +1,122 @@
+#include "trace.h"
+#include <sys/resource.h>
+#include <boost/format.hpp>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <map>
+
+using namespace std;
+
+namespace tmpst{
+    namespace trace{
+
+        atomic<bool> enabled(false);
+
+        namespace{
+            struct event{
+                const char * name;
+                double band;
+                int frame;
+                long long start, duration;   // microseconds since tracing started
+            };
+
+            // every thread writes its own events, the lists are only read once the threads are done
+            struct threadEvents{
+                int thread;
+                vector<event> events;
+            };
+
+            mutex registry_lock;
+            vector<shared_ptr<threadEvents>> registry;
+            chrono::steady_clock::time_point origin;
+
+            threadEvents & local(){
+                thread_local shared_ptr<threadEvents> mine;
+                if(!mine){
+                    mine = make_shared<threadEvents>();
+                    mine->events.reserve(1024);
+
+                    lock_guard<mutex> guard(registry_lock);
+                    mine->thread = registry.size();
+                    registry.push_back(mine);
+                }
+                return *mine;
+            }
+        }
+
+        void enable(){
+            origin = chrono::steady_clock::now();
+            enabled = true;
+        }
+
+        void record(const char * name, double band, int frame,
+                    chrono::steady_clock::time_point start, chrono::steady_clock::time_point end){
+            event new_event;
+            new_event.name = name;
+            new_event.band = band;
+            new_event.frame = frame;
+            new_event.start = chrono::duration_cast<chrono::microseconds>(start-origin).count();
+            new_event.duration = chrono::duration_cast<chrono::microseconds>(end-start).count();
+
+            local().events.push_back(new_event);
+        }
+
+        bool write(string filename){
+            ofstream output(filename);
+            if(!output){
+                cerr << "Could not open trace file: " << filename << endl;
+                return false;
+            }
+
+            lock_guard<mutex> guard(registry_lock);
+            output << "{\"traceEvents\": [" << endl;
+
+            bool first = true;
+            for(auto & thread_events : registry){
+                for(event & traced : thread_events->events){
+                    output << ((first) ? "" : ",\n")
+                           << "{\"name\": \"" << traced.name << "\", \"ph\": \"X\", \"pid\": 1"
+                           << ", \"tid\": " << thread_events->thread
+                           << ", \"ts\": " << traced.start << ", \"dur\": " << traced.duration
+                           << ", \"args\": {\"band\": " << fixed << traced.band << ", \"frame\": " << traced.frame << "}}";
+                    first = false;
+                }
+            }
+
+            output << endl << "]}" << endl;
+            return bool(output);
+        }
+
+        void summary(ostream & output){
+            struct stage{ long count = 0; long long total = 0, longest = 0; };
+            map<string, stage> stages;
+
+            {
+                lock_guard<mutex> guard(registry_lock);
+                for(auto & thread_events : registry){
+                    for(event & traced : thread_events->events){
+                        stage & current = stages[traced.name];
+                        current.count++;
+                        current.total += traced.duration;
+                        current.longest = max(current.longest, traced.duration);
+                    }
+                }
+            }
+
+            output << boost::format("%-20s %8s %12s %12s %12s") % "stage" % "count" % "total ms" % "mean ms" % "max ms" << endl;
+            for(auto & current : stages){
+                output << boost::format("%-20s %8d %12.3f %12.3f %12.3f")
+                          % current.first % current.second.count % (current.second.total/1000.0)
+                          % (current.second.total/1000.0/current.second.count) % (current.second.longest/1000.0) << endl;
+            }
+
+            struct rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            output << "peak RSS: " << usage.ru_maxrss/1024.0 << "MB" << endl; // ru_maxrss is in KB on linux
+        }
+
+    }
+}
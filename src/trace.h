@@ -0,0 +1,50 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <ostream>
+
+namespace tmpst{
+    namespace trace{
+
+        extern std::atomic<bool> enabled;
+
+        void enable();
+        bool write(std::string filename);       // chrome / perfetto trace event json
+        void summary(std::ostream & output);    // time per stage and peak memory
+
+        void record(const char * name, double band, int frame,
+                    std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+        /**
+         * Times the enclosing block. With tracing off this is one relaxed load.
+         * band is the band frequency (0 if it is not about one band), frame -1 if it is not about one frame.
+         */
+        class scope{
+        private:
+            const char * name;
+            double band;
+            int frame;
+            bool active;
+            std::chrono::steady_clock::time_point start;
+
+        public:
+            scope(const char * name, double band = 0, int frame = -1):
+                    name(name), band(band), frame(frame), active(enabled.load(std::memory_order_relaxed)){
+                if(active) start = std::chrono::steady_clock::now();
+            }
+
+            ~scope(){
+                if(active) record(name, band, frame, start, std::chrono::steady_clock::now());
+            }
+        };
+
+    }
+}
+
+#define TRACE_JOIN_(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN_(a, b)
+#define TRACE_SCOPE(...) tmpst::trace::scope TRACE_JOIN(trace_scope_, __LINE__)(__VA_ARGS__)
+
+#endif